@@ -0,0 +1,55 @@
+#ifdef MOOV_COUNT_ALLOCS
+
+#include <stdlib.h>
+#include <new>
+#include <algorithm>
+
+#include "alloc_count.h"
+
+static thread_local uint64_t allocations;
+
+uint64_t thread_allocations()
+{
+	return allocations;
+}
+
+void *alloc_count_malloc(size_t size, void *user_data)
+{
+	allocations++;
+	return malloc(size);
+}
+
+void alloc_count_free(void *ptr, void *user_data)
+{
+	free(ptr);
+}
+
+// The array, nothrow and sized forms all end up in these.
+void *operator new(size_t size)
+{
+	allocations++;
+	if (void *p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align)
+{
+	allocations++;
+	size_t a = std::max((size_t)align, sizeof(void *));
+	if (void *p = aligned_alloc(a, (size + a - 1) / a * a))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+#endif
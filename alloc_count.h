@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Counts heap allocations per thread, so a build with MOOV_COUNT_ALLOCS can
+// check that a steady-state frame does not allocate. Covers operator new
+// and, once alloc_count_malloc is handed to ImGui, ImGui's allocations too.
+#ifdef MOOV_COUNT_ALLOCS
+uint64_t thread_allocations();
+void *alloc_count_malloc(size_t size, void *user_data);
+void alloc_count_free(void *ptr, void *user_data);
+#endif
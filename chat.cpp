@@ -1,37 +1,259 @@
+#include <string.h>
+
 #include "moov.h"
 
+Chat::Chat()
+  : ring(max_messages), arena(arena_size)
+{
+  // Without the files the chat still works, it just forgets old messages.
+  index_file = tmpfile();
+  text_file = tmpfile();
+  if (index_file == nullptr || text_file == nullptr) {
+    if (index_file != nullptr)
+      fclose(index_file);
+    if (text_file != nullptr)
+      fclose(text_file);
+    index_file = text_file = nullptr;
+  }
+}
+
+Chat::~Chat()
+{
+  if (index_file != nullptr) {
+    fclose(index_file);
+    fclose(text_file);
+  }
+}
+
 void Chat::add_message(const Message &m)
 {
-  if (cursor != log.size())
+  if (cursor != total)
     last_end_scroll_time = std::chrono::steady_clock::now();
-  log.push_back(m);
-  cursor = log.size();
+
+  Record r;
+  r.text_offset = text_file_size;
+  r.text_size = std::min(m.text.size(), max_message_size);
+  r.fg = m.fg;
+  r.bg = m.bg;
+  r.time = m.time.time_since_epoch().count();
+
+  if (index_file != nullptr) {
+    fseek(index_file, 0, SEEK_END);
+    fseek(text_file, 0, SEEK_END);
+    if (fwrite(&r, sizeof(r), 1, index_file) == 1 &&
+      fwrite(m.text.data(), 1, r.text_size, text_file) == r.text_size) {
+      text_file_size += r.text_size;
+    } else {
+      // The file no longer lines up with the numbering, so stop using it.
+      fclose(index_file);
+      fclose(text_file);
+      index_file = text_file = nullptr;
+    }
+  }
+
+  // New messages scroll the chat to the end, so that is what has to be in
+  // memory.
+  if (first + count != total)
+    load_around(total);
+  total++;
+  push(r, m.text.data());
+  cursor = total;
 }
 
-std::pair<Message *, size_t> Chat::messages()
+Chat_Message *Chat::message(size_t i)
 {
-  if (log.size() == 0)
-    return {nullptr, 0};
-  return { &log[0], cursor };
+  if (i < first || i >= first + count)
+    return nullptr;
+  return &ring[(first_slot + (i - first)) % max_messages];
 }
 
 void Chat::scroll_up()
 {
   if (cursor > 10)
     cursor--;
-  if (cursor == log.size())
+  if (cursor == total)
     last_end_scroll_time = std::chrono::steady_clock::now();
+  if (index_file != nullptr && cursor < first + std::min(page_size, cursor))
+    load_around(cursor);
 }
 
 void Chat::scroll_down()
 {
-  if (cursor < log.size())
+  if (cursor < total)
     cursor++;
-  if (cursor == log.size())
+  if (cursor == total)
     last_end_scroll_time = std::chrono::steady_clock::now();
+  if (index_file != nullptr && cursor > first + count)
+    load_around(cursor);
 }
 
 time_point Chat::get_last_end_scroll_time()
 {
   return last_end_scroll_time;
 }
+
+// Appends message number first + count.
+void Chat::push(const Record &r, const char *text)
+{
+  if (count == max_messages)
+    pop_oldest();
+  char *p = arena_alloc(r.text_size);
+  memcpy(p, text, r.text_size);
+
+  auto &m = ring[(first_slot + count) % max_messages];
+  m.text = std::string_view(p, r.text_size);
+  m.time = time_point(time_point::duration(r.time));
+  m.fg = r.fg;
+  m.bg = r.bg;
+  m.geometry = Message_Geometry();
+  count++;
+}
+
+void Chat::pop_oldest()
+{
+  ring[first_slot].geometry = Message_Geometry();
+  first++;
+  first_slot = (first_slot + 1) % max_messages;
+  count--;
+}
+
+// Texts are stored in the order of the messages, wrapping around at the
+// end of the arena, so the free space is always the stretch between the
+// newest text and the oldest.
+char *Chat::arena_alloc(size_t size)
+{
+  // Empty texts still take a byte, so that head and tail only meet when
+  // nothing is in use.
+  size = std::max(size, (size_t)1);
+  for (;;) {
+    if (count == 0) {
+      arena_head = 0;
+      break;
+    }
+    size_t tail = ring[first_slot].text.data() - arena.data();
+    if (arena_head > tail && size <= arena_size - arena_head)
+      break;
+    if (arena_head > tail && size < tail) {
+      arena_head = 0;
+      break;
+    }
+    if (arena_head < tail && arena_head + size < tail)
+      break;
+    pop_oldest();
+  }
+  char *p = arena.data() + arena_head;
+  arena_head += size;
+  return p;
+}
+
+// Replaces what is in memory with the messages around at, read back from
+// the file. Those up to page_size before at come first, as they are the
+// ones on screen, then up to page_size after it, then more before it, for as
+// many as fit.
+void Chat::load_around(size_t at)
+{
+  while (count > 0)
+    pop_oldest();
+  first = at;
+  if (index_file == nullptr)
+    return;
+
+  size_t begin = at > 2 * page_size ? at - 2 * page_size : 0;
+  size_t end = std::min(total, at + page_size);
+  Record records[3 * page_size];
+  fseek(index_file, begin * sizeof(Record), SEEK_SET);
+  end = begin + fread(records, sizeof(Record), end - begin, index_file);
+  at = std::min(at, end);
+
+  size_t lo = at, hi = at, used = 0;
+  auto fits = [&](size_t i) {
+    size_t size = std::max(records[i - begin].text_size, (uint32_t)1);
+    if (hi - lo == max_messages || used + size > arena_size)
+      return false;
+    used += size;
+    return true;
+  };
+  while (lo > begin && at - lo < page_size && fits(lo - 1))
+    lo--;
+  while (hi < end && hi - at < page_size && fits(hi))
+    hi++;
+  while (lo > begin && fits(lo - 1))
+    lo--;
+
+  first = lo;
+  static char text[max_message_size];
+  for (size_t i = lo; i < hi; i++) {
+    auto &r = records[i - begin];
+    fseek(text_file, r.text_offset, SEEK_SET);
+    if (fread(text, 1, r.text_size, text_file) != r.text_size)
+      break;
+    push(r, text);
+  }
+}
+
+void Chat_Ingest::refill(time_point now)
+{
+  double elapsed = std::chrono::duration<double>(now - last_refill).count();
+  tokens = std::min(burst, tokens + elapsed * rate);
+  last_refill = now;
+}
+
+bool Chat_Ingest::admit(time_point now)
+{
+  refill(now);
+  // Held messages are older, so nothing overtakes them.
+  if (!held.empty() || tokens < 1)
+    return false;
+  tokens--;
+  return true;
+}
+
+void Chat_Ingest::hold(std::string_view text, std::string_view fg, std::string_view bg)
+{
+  // Past the window, the last one held stands for all that came after:
+  // each newer message replaces it, and it says how many it replaced.
+  if (held.size() > max_held) {
+    held.back().folded++;
+    stats.chat_collapsed++;
+  } else {
+    held.emplace_back();
+  }
+  Held &h = held.back();
+  h.text.assign(text);
+  h.fg.assign(fg);
+  h.bg.assign(bg);
+}
+
+bool Chat_Ingest::take_held(time_point now, Message &out)
+{
+  if (held.empty())
+    return false;
+  refill(now);
+  if (tokens < 1)
+    return false;
+  tokens--;
+
+  Held &h = held.front();
+  out.text.clear();
+  if (h.folded > 0) {
+    out.text += "(";
+    out.text += std::to_string(h.folded);
+    out.text += h.folded == 1 ? " message collapsed) " : " messages collapsed) ";
+  }
+  out.text += h.text;
+  // Fades from when it is shown.
+  out.time = now;
+  out.fg = decode_color(h.fg);
+  out.bg = decode_color(h.bg);
+  held.pop_front();
+  return true;
+}
+
+std::optional<time_point> Chat_Ingest::next_release() const
+{
+  if (held.empty())
+    return std::nullopt;
+  double wait = std::max(0.0, (1 - tokens) / rate);
+  return last_refill + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(wait));
+}
+
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// The canonical playback position as an anchor: at monotonic time
+// anchor_us the media was at media_time, and from there it advances at
+// rate unless paused. The time at any moment is computed from the anchor,
+// so nothing has to run per frame to keep it current and no error
+// accumulates.
+struct Clock_Anchor {
+	int64_t anchor_us;
+	double media_time;
+	bool paused;
+	double rate;
+
+	double at(int64_t now_us) const
+	{
+		if (paused)
+			return media_time;
+		return media_time + (double)(now_us - anchor_us) * 1e-6 * rate;
+	}
+};
+
+// Single writer, any number of readers on any thread. Readers never block;
+// the anchor is published through a sequence lock.
+class Canonical_Clock {
+public:
+	static int64_t now_us()
+	{
+		using namespace std::chrono;
+		return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	void set(int64_t now_us, double time, bool paused, double rate = 1.0)
+	{
+		uint32_t s = seq.load(std::memory_order_relaxed);
+		seq.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		a_anchor_us.store(now_us, std::memory_order_relaxed);
+		a_media_time.store(time, std::memory_order_relaxed);
+		a_paused.store(paused, std::memory_order_relaxed);
+		a_rate.store(rate, std::memory_order_relaxed);
+		seq.store(s + 2, std::memory_order_release);
+	}
+
+	// Re-anchors at now, so the time up to now is kept.
+	void set_paused(int64_t now_us, bool paused)
+	{
+		Clock_Anchor a = anchor();
+		set(now_us, a.at(now_us), paused, a.rate);
+	}
+
+	Clock_Anchor anchor() const
+	{
+		Clock_Anchor a;
+		uint32_t s1, s2;
+		do {
+			s1 = seq.load(std::memory_order_acquire);
+			a.anchor_us = a_anchor_us.load(std::memory_order_relaxed);
+			a.media_time = a_media_time.load(std::memory_order_relaxed);
+			a.paused = a_paused.load(std::memory_order_relaxed);
+			a.rate = a_rate.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			s2 = seq.load(std::memory_order_relaxed);
+		} while ((s1 & 1) || s1 != s2);
+		return a;
+	}
+
+	double time(int64_t now_us) const
+	{
+		return anchor().at(now_us);
+	}
+
+	double time() const
+	{
+		return time(now_us());
+	}
+
+	bool paused() const
+	{
+		return anchor().paused;
+	}
+
+private:
+	std::atomic<uint32_t> seq = 0;
+	std::atomic<int64_t> a_anchor_us = 0;
+	std::atomic<double> a_media_time = 0;
+	std::atomic<bool> a_paused = true;
+	std::atomic<double> a_rate = 1.0;
+};
@@ -20,8 +20,14 @@ class Moov:
 		self._control_queue = queue.Queue()
 		self._replies = dict()
 		self._replies_lock = threading.Lock()
+		# Local copy of moov's status kept up to date by status_update
+		# messages, with the monotonic time its 'time' was received at.
+		self._status = None
+		self._status_time = 0
+		self._status_lock = threading.Lock()
 		self._reader_thread = threading.Thread(target=self._reader)
 		self._reader_thread.start()
+		self._write({'type': 'subscribe_status', 'max_rate': 20})
 
 	def _write(self, v):
 		self._proc.stdin.write(json.dumps(v))
@@ -33,19 +39,59 @@ class Moov:
 			msg = json.loads(line)
 			if msg['type'] == 'control':
 				self._control_queue.put(msg)
-			if msg['type'] == 'status':
+			if msg['type'] in ('status', 'stats', 'resolved'):
 				with self._replies_lock:
 					self._replies[msg['request_id']] = msg
 			if msg['type'] == 'user_input':
 				self._message_queue.put(msg['text'])
+			if msg['type'] == 'status_update':
+				self._update_status(msg)
 		self._proc.stdout.close()
 
-	def _request_status(self):
-		request_id = self._status_request_counter
-		self._status_request_counter += 1
-		self._write({'type': 'request_status', 'request_id': request_id})
+	def _update_status(self, changes, local=False):
+		with self._status_lock:
+			if self._status is None:
+				# Local changes are only applied on top of a status
+				# received from moov.
+				if local:
+					return
+				self._status = {
+					'playlist_position': 0,
+					'playlist_count': 0,
+					'paused': True,
+					'time': 0,
+					'delay': 0
+				}
+			if 'time' in changes:
+				self._status_time = time.monotonic()
+			for k in self._status:
+				if k in changes:
+					self._status[k] = changes[k]
+
+	def _mirror_status(self):
+		with self._status_lock:
+			if self._status is None:
+				return None
+			status = dict(self._status)
+			if not status['paused']:
+				status['time'] += time.monotonic() - self._status_time
+			return status
+
+	# Requests are made from more than one thread.
+	def _next_request_id(self):
+		with self._replies_lock:
+			request_id = self._status_request_counter
+			self._status_request_counter += 1
+		return request_id
+
+	def _request(self, type):
+		request_id = self._next_request_id()
+		self._write({'type': type, 'request_id': request_id})
 		return request_id
 
+	def _request_status(self):
+		return self._request('request_status')
+
 	def _await_reply(self, request_id):
 		while True:
 			with self._replies_lock:
@@ -71,6 +117,11 @@ class Moov:
 
 	def index(self, position):
 		self._write({'type': 'set_playlist_position', 'position': position})
+		self._update_status({
+			'playlist_position': position,
+			'paused': True,
+			'time': 0
+		}, local=True)
 
 	def previous(self):
 		pl_pos = self.get_status()['playlist_position']
@@ -86,9 +137,26 @@ class Moov:
 
 	def append(self, path):
 		self._write({'type': 'add_file', 'file_path': path})
+		status = self._mirror_status()
+		if status is not None:
+			count = status['playlist_count'] + 1
+			self._update_status({'playlist_count': count}, local=True)
+
+	def append_all(self, paths):
+		self._write({'type': 'add_files', 'files': list(paths)})
+		status = self._mirror_status()
+		if status is not None:
+			count = status['playlist_count'] + len(paths)
+			self._update_status({'playlist_count': count}, local=True)
 
 	def clear_playlist(self):
 		self._write({'type': 'playlist_clear'})
+		self._update_status({
+			'playlist_position': 0,
+			'playlist_count': 0,
+			'paused': True,
+			'time': 0
+		}, local=True)
 
 	def set_canonical(self, playlist_position, paused, time):
 		self._write({
@@ -97,9 +165,17 @@ class Moov:
 			'paused': paused,
 			'time': time
 		})
+		self._update_status({
+			'playlist_position': playlist_position,
+			'paused': paused,
+			'time': time
+		}, local=True)
 
 	def set_paused(self, paused):
 		self._write({'type': 'pause', 'paused': paused})
+		status = self._mirror_status()
+		if status is not None:
+			self._update_status({'paused': paused, 'time': status['time']}, local=True)
 
 	def toggle_paused(self):
 		paused = self.get_status()['paused']
@@ -107,15 +183,41 @@ class Moov:
 
 	def seek(self, time):
 		self._write({'type': 'seek', 'time': time})
+		self._update_status({'time': time}, local=True)
 
 	def relative_seek(self, time_delta):
 		time = self.get_status()['time']
 		self.seek(time + time_delta)
 
 	def get_status(self):
+		# Commands sent through this object are applied to the mirror
+		# straight away, so it reflects them without a round trip.
+		status = self._mirror_status()
+		if status is not None:
+			return status
 		request_id = self._request_status()
 		return self._await_reply(request_id)
 
+	# Video information for url from moov's resolver, in the form of
+	# moovdb.download_info, or None if it could not be resolved.
+	def resolve(self, url):
+		request_id = self._next_request_id()
+		self._write({'type': 'resolve', 'url': url, 'request_id': request_id})
+		reply = self._await_reply(request_id)
+		if not reply['ok']:
+			return None
+		return {
+		    'url': url,
+		    'title': reply['title'],
+		    'uploader': reply['uploader'] or 'Unknown',
+		    'uploader_url': reply['uploader_url'] or None,
+		    'duration': reply['duration'] or None
+		}
+
+	def get_stats(self):
+		request_id = self._request('request_stats')
+		return self._await_reply(request_id)
+
 	def get_user_inputs(self):
 		inputs = list(self._message_queue.queue)
 		self._message_queue.queue.clear()
@@ -243,8 +243,7 @@ class MoovPlugin(GajimPlugin):
 					return
 				self.conv = conv
 				self.open_moov()
-				for video_file in results:
-					self.moov.append(video_file)
+				self.moov.append_all(results)
 				self.moov.index(playlist_position)
 				self.moov.seek(time)
 				self.send_message(conv, format_status(self.moov.get_status()))
@@ -298,8 +297,7 @@ class MoovPlugin(GajimPlugin):
 				self.send_message(conv, format_status(self.moov.get_status()))
 			elif session['type'] == 'search':
 				self.conv = conv
-				for video_file in session['files']:
-					self.moov.append(video_file)
+				self.moov.append_all(session['files'])
 				self.moov.index(session['playlist_position'])
 				self.moov.seek(session['time'])
 				self.send_message(conv, f'.lor "{session["search"]}" {session["playlist_position"]+1} {format_time(session["time"])}')
@@ -378,7 +376,13 @@ class MoovPlugin(GajimPlugin):
 
 	def download_info(self, url, callback, conv):
 		try:
-			info = moovdb.download_info(url)
+			# A running moov has youtube-dl loaded already and may have
+			# the URL cached.
+			info = None
+			if self.moov is not None and self.moov.alive():
+				info = self.moov.resolve(url)
+			if info is None:
+				info = moovdb.download_info(url)
 			GLib.idle_add(callback, info)
 		except:
 			GLib.idle_add(self.send_message, conv, 'error: could not get video information')
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <charconv>
+#include <cstring>
+#include <type_traits>
+
+// Text built up in place like a stringstream, for the frame path where
+// nothing should touch the heap. Whatever does not fit is cut off.
+template <size_t N>
+class Fixed_Text {
+public:
+	Fixed_Text &operator<<(const char *s)
+	{
+		size_t n = std::min(strlen(s), (size_t)(end() - p));
+		memcpy(p, s, n);
+		p += n;
+		return *this;
+	}
+
+	Fixed_Text &operator<<(char c)
+	{
+		if (p < end())
+			*p++ = c;
+		return *this;
+	}
+
+	template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+	Fixed_Text &operator<<(T v)
+	{
+		auto r = std::to_chars(p, end(), v);
+		if (r.ec == std::errc())
+			p = r.ptr;
+		return *this;
+	}
+
+	const char *c_str()
+	{
+		*p = '\0';
+		return buf;
+	}
+
+private:
+	char *end() { return buf + N - 1; }
+
+	char buf[N];
+	char *p = buf;
+};
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+
+# Plays generated media in moov --headless and reports how fast commands
+# are answered, how closely playback follows the canonical clock and what
+# that costs. Needs no display, GPU or network.
+#
+#	./headless_bench.py [null|sw] [seconds]
+
+import json
+import subprocess
+import sys
+import threading
+import time
+
+MEDIA = 'av://lavfi:testsrc2=size=1280x720:rate=30[out0];sine=frequency=440[out1]'
+STATUS_REQUESTS = 2000
+# prefetch_pause in mpvh.cpp.
+PREFETCH_PAUSE = 10
+
+
+class Headless_Moov:
+	def __init__(self, mode):
+		self.proc = subprocess.Popen(['./moov', f'--headless={mode}'],
+		                             stdin=subprocess.PIPE,
+		                             stdout=subprocess.PIPE,
+		                             text=True,
+		                             bufsize=1)
+		self.replies = {}
+		self.cond = threading.Condition()
+		self.next_id = 1
+		threading.Thread(target=self.read, daemon=True).start()
+
+	def read(self):
+		for line in self.proc.stdout:
+			try:
+				msg = json.loads(line)
+			except ValueError:
+				continue
+			if 'request_id' in msg:
+				with self.cond:
+					self.replies[msg['request_id']] = msg
+					self.cond.notify_all()
+
+	def send(self, **msg):
+		self.proc.stdin.write(json.dumps(msg) + '\n')
+
+	def request(self, type):
+		id = self.next_id
+		self.next_id += 1
+		self.send(type=type, request_id=id)
+		return id
+
+	def wait(self, id, timeout=10):
+		with self.cond:
+			if not self.cond.wait_for(lambda: id in self.replies, timeout):
+				sys.exit(f'no reply to request {id}')
+			return self.replies.pop(id)
+
+	def call(self, type):
+		return self.wait(self.request(type))
+
+	def close(self):
+		self.proc.stdin.close()
+		self.proc.wait(10)
+
+
+def percentile(values, p):
+	values = sorted(values)
+	return values[min(len(values) - 1, int(p * len(values)))]
+
+
+def main():
+	mode = sys.argv[1] if len(sys.argv) > 1 else 'null'
+	seconds = float(sys.argv[2]) if len(sys.argv) > 2 else 10
+
+	moov = Headless_Moov(mode)
+	moov.send(type='add_file', file_path=MEDIA)
+	moov.send(type='add_file', file_path=MEDIA)
+	moov.send(type='set_canonical', playlist_position=0, paused=False, time=0)
+	time.sleep(2)
+	moov.call('request_stats')
+
+	start = time.monotonic()
+	ids = [moov.request('request_status') for _ in range(STATUS_REQUESTS)]
+	for id in ids:
+		moov.wait(id)
+	elapsed = time.monotonic() - start
+	print(f'status requests  {STATUS_REQUESTS / elapsed:10.0f} /s')
+
+	delays = []
+	end = time.monotonic() + seconds
+	while time.monotonic() < end:
+		delays.append(abs(moov.call('request_status')['delay']))
+		time.sleep(0.1)
+	print(f'delay p50        {percentile(delays, 0.5) * 1000:10.1f} ms')
+	print(f'delay p99        {percentile(delays, 0.99) * 1000:10.1f} ms')
+
+	# A canonical jump far enough ahead that the player has to seek.
+	status = moov.call('request_status')
+	moov.send(type='set_canonical', playlist_position=0, paused=False, time=status['time'] + 60)
+	start = time.monotonic()
+	while abs(moov.call('request_status')['delay']) > 0.1:
+		if time.monotonic() - start > 30:
+			sys.exit('did not catch up after a jump')
+		time.sleep(0.01)
+	print(f'jump caught up   {(time.monotonic() - start) * 1000:10.1f} ms')
+
+	# Paused for longer than prefetch_pause, the next entry is opened
+	# ahead of time even though nothing else happens meanwhile.
+	moov.call('request_stats')
+	status = moov.call('request_status')
+	moov.send(type='set_canonical', playlist_position=0, paused=True, time=status['time'])
+	time.sleep(PREFETCH_PAUSE + 1)
+	if moov.call('request_stats')['prefetches'] < 1:
+		sys.exit('did not prefetch while paused')
+	print(f'paused prefetch  {"yes":>10}')
+
+	moov.send(type='set_canonical', playlist_position=1, paused=False, time=0)
+	start = time.monotonic()
+	while True:
+		status = moov.call('request_status')
+		if status['playlist_position'] == 1 and abs(status['delay']) < 0.1:
+			break
+		if time.monotonic() - start > 30:
+			sys.exit('did not switch to the next entry')
+		time.sleep(0.01)
+	print(f'switch in sync   {(time.monotonic() - start) * 1000:10.1f} ms')
+
+	stats = moov.call('request_stats')
+	print(f'first frame      {stats["switch_time_max"] * 1000:10.1f} ms')
+	print(f'cpu usage        {stats["cpu_usage"] * 100:10.1f} %')
+	print(f'frames           {stats["frames"] / stats["interval"]:10.1f} /s')
+	print(f'wakeups          {stats["wakeups"] / stats["interval"]:10.1f} /s')
+	print(f'mpv calls        {stats["mpv_calls"]:10}')
+	moov.close()
+
+
+main()
@@ -0,0 +1,621 @@
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+#include "ipc.h"
+
+using json = nlohmann::json;
+
+// A scalar value in the line, pointing into the line buffer. Strings are
+// still escaped; they are unescaped in place once the whole command has
+// been validated, so a failed fast parse leaves the text intact for the
+// fallback.
+struct Token {
+	enum Kind { STRING, NUMBER, BOOLEAN, NUL } kind;
+	char *str;
+	size_t len;
+	bool escaped;
+};
+
+struct Field {
+	std::string_view key;
+	Token value;
+};
+
+// Flat JSON object with scalar values, which is all the known commands
+// use. Anything else (nested values, escaped keys, too many fields) makes
+// scan() fail.
+struct Object_Scan {
+	static constexpr int max_fields = 16;
+	Field fields[max_fields];
+	int count = 0;
+
+	bool scan(char *p, char *end);
+	const Token *find(std::string_view key) const;
+	const Token *find(std::string_view key, Token::Kind kind) const;
+};
+
+static void skip_ws(char *&p, char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+}
+
+static bool is_hex(char c)
+{
+	return ('0' <= c && c <= '9') || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F');
+}
+
+static bool scan_string(char *&p, char *end, Token &t)
+{
+	t.kind = Token::STRING;
+	t.escaped = false;
+	t.str = ++p;
+	while (p < end) {
+		unsigned char c = *p;
+		if (c == '"') {
+			t.len = p - t.str;
+			p++;
+			return true;
+		}
+		if (c < 0x20)
+			return false;
+		if (c != '\\') {
+			p++;
+			continue;
+		}
+		t.escaped = true;
+		if (end - p < 2)
+			return false;
+		char e = p[1];
+		if (e == 'u') {
+			if (end - p < 6)
+				return false;
+			for (int i = 2; i < 6; i++)
+				if (!is_hex(p[i]))
+					return false;
+			p += 6;
+		} else if (e != '\0' && strchr("\"\\/bfnrt", e)) {
+			p += 2;
+		} else {
+			return false;
+		}
+	}
+	return false;
+}
+
+static bool scan_literal(char *&p, char *end, const char *lit)
+{
+	size_t n = strlen(lit);
+	if ((size_t)(end - p) < n || memcmp(p, lit, n) != 0)
+		return false;
+	p += n;
+	return true;
+}
+
+static bool scan_value(char *&p, char *end, Token &t)
+{
+	t.escaped = false;
+	t.str = p;
+	switch (*p) {
+	case '"':
+		return scan_string(p, end, t);
+	case 't':
+		t.kind = Token::BOOLEAN;
+		t.len = 4;
+		return scan_literal(p, end, "true");
+	case 'f':
+		t.kind = Token::BOOLEAN;
+		t.len = 5;
+		return scan_literal(p, end, "false");
+	case 'n':
+		t.kind = Token::NUL;
+		t.len = 4;
+		return scan_literal(p, end, "null");
+	}
+	t.kind = Token::NUMBER;
+	while (p < end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E'))
+		p++;
+	t.len = p - t.str;
+	return t.len > 0;
+}
+
+bool Object_Scan::scan(char *p, char *end)
+{
+	skip_ws(p, end);
+	if (p == end || *p++ != '{')
+		return false;
+	skip_ws(p, end);
+	if (p < end && *p == '}') {
+		p++;
+	} else {
+		while (1) {
+			if (count == max_fields || p == end || *p != '"')
+				return false;
+			Token key;
+			if (!scan_string(p, end, key) || key.escaped)
+				return false;
+			skip_ws(p, end);
+			if (p == end || *p++ != ':')
+				return false;
+			skip_ws(p, end);
+			if (p == end || !scan_value(p, end, fields[count].value))
+				return false;
+			fields[count].key = std::string_view(key.str, key.len);
+			count++;
+			skip_ws(p, end);
+			if (p == end)
+				return false;
+			if (*p == '}') {
+				p++;
+				break;
+			}
+			if (*p++ != ',')
+				return false;
+			skip_ws(p, end);
+		}
+	}
+	skip_ws(p, end);
+	return p == end;
+}
+
+const Token *Object_Scan::find(std::string_view key) const
+{
+	// Last one wins on duplicate keys, as with nlohmann::json.
+	for (int i = count - 1; i >= 0; i--)
+		if (fields[i].key == key)
+			return &fields[i].value;
+	return nullptr;
+}
+
+const Token *Object_Scan::find(std::string_view key, Token::Kind kind) const
+{
+	const Token *t = find(key);
+	return t != nullptr && t->kind == kind ? t : nullptr;
+}
+
+static uint32_t hex4(const char *s)
+{
+	uint32_t v = 0;
+	std::from_chars(s, s + 4, v, 16);
+	return v;
+}
+
+static char *put_utf8(char *w, uint32_t cp)
+{
+	if (cp < 0x80) {
+		*w++ = cp;
+	} else if (cp < 0x800) {
+		*w++ = 0xC0 | (cp >> 6);
+		*w++ = 0x80 | (cp & 0x3F);
+	} else if (cp < 0x10000) {
+		*w++ = 0xE0 | (cp >> 12);
+		*w++ = 0x80 | ((cp >> 6) & 0x3F);
+		*w++ = 0x80 | (cp & 0x3F);
+	} else {
+		*w++ = 0xF0 | (cp >> 18);
+		*w++ = 0x80 | ((cp >> 12) & 0x3F);
+		*w++ = 0x80 | ((cp >> 6) & 0x3F);
+		*w++ = 0x80 | (cp & 0x3F);
+	}
+	return w;
+}
+
+// Unescapes in place and NUL-terminates, which always fits: every escape
+// sequence is at least as long as what it decodes to, and the closing quote
+// leaves room for the terminator.
+static std::string_view unescape(const Token &t)
+{
+	char *r = t.str, *w = t.str, *end = t.str + t.len;
+	while (t.escaped && r < end) {
+		if (*r != '\\') {
+			*w++ = *r++;
+			continue;
+		}
+		char e = r[1];
+		r += 2;
+		switch (e) {
+		case 'b': *w++ = '\b'; break;
+		case 'f': *w++ = '\f'; break;
+		case 'n': *w++ = '\n'; break;
+		case 'r': *w++ = '\r'; break;
+		case 't': *w++ = '\t'; break;
+		case 'u': {
+			uint32_t cp = hex4(r);
+			r += 4;
+			if (cp >= 0xD800 && cp < 0xDC00 && end - r >= 6 && r[0] == '\\' && r[1] == 'u') {
+				uint32_t lo = hex4(r + 2);
+				if (lo >= 0xDC00 && lo < 0xE000) {
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+					r += 6;
+				}
+			}
+			if (cp >= 0xD800 && cp < 0xE000)
+				cp = 0xFFFD;
+			w = put_utf8(w, cp);
+			break;
+		}
+		default: *w++ = e; break;
+		}
+	}
+	if (!t.escaped)
+		w = end;
+	*w = '\0';
+	return std::string_view(t.str, w - t.str);
+}
+
+static bool to_double(const Token *t, double &out)
+{
+	auto res = std::from_chars(t->str, t->str + t->len, out);
+	return res.ec == std::errc() && res.ptr == t->str + t->len;
+}
+
+static bool to_int(const Token *t, int64_t &out)
+{
+	auto res = std::from_chars(t->str, t->str + t->len, out);
+	if (res.ec == std::errc() && res.ptr == t->str + t->len)
+		return true;
+	double d;
+	if (!to_double(t, d))
+		return false;
+	out = d;
+	return true;
+}
+
+static bool parse_fast(Input_Line &line)
+{
+	Object_Scan o;
+	char *begin = line.text.data();
+	if (!o.scan(begin, begin + line.text.size()))
+		return false;
+
+	const Token *type_tok = o.find("type", Token::STRING);
+	if (type_tok == nullptr || type_tok->escaped) {
+		line.cmd = std::monostate();
+		return true;
+	}
+	std::string_view type(type_tok->str, type_tok->len);
+
+	auto str = [&](const char *key) { return o.find(key, Token::STRING); };
+	auto num = [&](const char *key) { return o.find(key, Token::NUMBER); };
+	auto flag = [&](const char *key, bool &out) {
+		const Token *t = o.find(key, Token::BOOLEAN);
+		if (t != nullptr)
+			out = t->str[0] == 't';
+		return t != nullptr;
+	};
+	// Optional number: fails only if the field is there with another type.
+	auto opt_double = [&](const char *key, double &out) {
+		if (o.find(key) == nullptr)
+			return true;
+		auto t = num(key);
+		return t != nullptr && to_double(t, out);
+	};
+
+	if (type == "pause") {
+		Pause_Cmd c;
+		if (!flag("paused", c.paused))
+			return false;
+		line.cmd = c;
+	} else if (type == "seek") {
+		Seek_Cmd c;
+		auto time = num("time");
+		if (!time || !to_double(time, c.time))
+			return false;
+		line.cmd = c;
+	} else if (type == "message") {
+		auto msg = str("message"), fg = str("fg_color"), bg = str("bg_color");
+		if (!msg || !fg || !bg)
+			return false;
+		line.cmd = Message_Cmd{ unescape(*msg), unescape(*fg), unescape(*bg) };
+	} else if (type == "add_file") {
+		auto path = str("file_path");
+		if (!path)
+			return false;
+		line.cmd = Add_File_Cmd{ unescape(*path) };
+	} else if (type == "add_files") {
+		// A files array is not a flat value, so that form never gets
+		// here and is decoded by the fallback.
+		Add_Files_Cmd c;
+		auto playlist = str("playlist");
+		auto id = num("request_id");
+		if (!playlist || (o.find("request_id") && (!id || !to_int(id, c.request_id))))
+			return false;
+		c.playlist = unescape(*playlist);
+		line.cmd = std::move(c);
+	} else if (type == "playlist_clear") {
+		line.cmd = Playlist_Clear_Cmd();
+	} else if (type == "set_playlist_position") {
+		Set_Playlist_Position_Cmd c;
+		auto pos = num("position");
+		if (!pos || !to_int(pos, c.position))
+			return false;
+		line.cmd = c;
+	} else if (type == "set_canonical") {
+		Set_Canonical_Cmd c;
+		auto pos = num("playlist_position"), time = num("time");
+		if (!pos || !time || !to_int(pos, c.playlist_position)
+				|| !to_double(time, c.time) || !flag("paused", c.paused))
+			return false;
+		line.cmd = c;
+	} else if (type == "request_status" || type == "request_stats") {
+		int64_t id;
+		auto id_tok = num("request_id");
+		if (!id_tok || !to_int(id_tok, id))
+			return false;
+		if (type == "request_status")
+			line.cmd = Request_Status_Cmd{ id };
+		else
+			line.cmd = Request_Stats_Cmd{ id };
+	} else if (type == "subscribe_status") {
+		Subscribe_Status_Cmd c;
+		if (!opt_double("max_rate", c.max_rate) || !opt_double("heartbeat", c.heartbeat))
+			return false;
+		line.cmd = c;
+	} else if (type == "unsubscribe_status") {
+		line.cmd = Unsubscribe_Status_Cmd();
+	} else if (type == "set_property") {
+		auto prop = str("property"), value = str("value");
+		if (!prop || !value)
+			return false;
+		line.cmd = Set_Property_Cmd{ unescape(*prop), unescape(*value) };
+	} else if (type == "dump_trace") {
+		Dump_Trace_Cmd c;
+		auto id = num("request_id");
+		if (!opt_double("seconds", c.seconds)
+				|| (o.find("request_id") && (!id || !to_int(id, c.request_id))))
+			return false;
+		if (o.find("path")) {
+			auto path = str("path");
+			if (!path)
+				return false;
+			c.path = unescape(*path);
+		}
+		line.cmd = c;
+	} else if (type == "resolve") {
+		Resolve_Cmd c;
+		auto url = str("url");
+		auto id = num("request_id");
+		if (!url || (o.find("request_id") && (!id || !to_int(id, c.request_id))))
+			return false;
+		c.url = unescape(*url);
+		line.cmd = c;
+	} else if (type == "close") {
+		line.cmd = Close_Cmd();
+	} else {
+		line.cmd = std::monostate();
+	}
+	return true;
+}
+
+static void parse_fallback(Input_Line &line)
+{
+	line.fallback = json::parse(line.text);
+	line.cmd = std::monostate();
+
+	json &j = line.fallback;
+	auto type_it = j.find("type");
+	if (type_it == j.end())
+		return;
+
+	auto str = [&](const char *key) {
+		return std::string_view(j.at(key).get_ref<const std::string &>());
+	};
+
+	auto &type = *type_it;
+	if (type == "pause")
+		line.cmd = Pause_Cmd{ j.at("paused").get<bool>() };
+	else if (type == "seek")
+		line.cmd = Seek_Cmd{ j.at("time").get<double>() };
+	else if (type == "message")
+		line.cmd = Message_Cmd{ str("message"), str("fg_color"), str("bg_color") };
+	else if (type == "add_file")
+		line.cmd = Add_File_Cmd{ str("file_path") };
+	else if (type == "add_files") {
+		Add_Files_Cmd c;
+		if (j.contains("files"))
+			for (auto &f : j.at("files"))
+				c.files.push_back(f.get_ref<const std::string &>());
+		if (j.contains("playlist"))
+			c.playlist = str("playlist");
+		c.request_id = j.value("request_id", c.request_id);
+		line.cmd = std::move(c);
+	}
+	else if (type == "playlist_clear")
+		line.cmd = Playlist_Clear_Cmd();
+	else if (type == "set_playlist_position")
+		line.cmd = Set_Playlist_Position_Cmd{ j.at("position").get<int64_t>() };
+	else if (type == "set_canonical")
+		line.cmd = Set_Canonical_Cmd{
+			j.at("playlist_position").get<int64_t>(),
+			j.at("paused").get<bool>(),
+			j.at("time").get<double>()
+		};
+	else if (type == "request_status")
+		line.cmd = Request_Status_Cmd{ j.at("request_id").get<int64_t>() };
+	else if (type == "request_stats")
+		line.cmd = Request_Stats_Cmd{ j.at("request_id").get<int64_t>() };
+	else if (type == "subscribe_status")
+		line.cmd = Subscribe_Status_Cmd{
+			j.value("max_rate", Subscribe_Status_Cmd().max_rate),
+			j.value("heartbeat", Subscribe_Status_Cmd().heartbeat)
+		};
+	else if (type == "unsubscribe_status")
+		line.cmd = Unsubscribe_Status_Cmd();
+	else if (type == "set_property")
+		line.cmd = Set_Property_Cmd{ str("property"), str("value") };
+	else if (type == "dump_trace") {
+		Dump_Trace_Cmd c;
+		c.seconds = j.value("seconds", c.seconds);
+		if (j.contains("path"))
+			c.path = str("path");
+		c.request_id = j.value("request_id", c.request_id);
+		line.cmd = c;
+	}
+	else if (type == "resolve")
+		line.cmd = Resolve_Cmd{ str("url"), j.value("request_id", Resolve_Cmd().request_id) };
+	else if (type == "close")
+		line.cmd = Close_Cmd();
+}
+
+void parse_command(Input_Line &line)
+{
+	if (!line.fallback.is_null())
+		line.fallback = nullptr;
+	if (!parse_fast(line))
+		parse_fallback(line);
+}
+
+struct Pending_Output {
+	std::string type;
+	std::string line;
+};
+
+static constexpr size_t max_pending_output = 1024;
+
+// Never destroyed: the writer thread is detached and may still be waiting
+// on the condition variable while static destructors run at exit.
+struct Output_State {
+	std::mutex lock;
+	std::condition_variable cond;
+	std::vector<Pending_Output> queue;
+	Output_Stats stats = {};
+	bool writing = false;
+};
+
+static Output_State *output;
+
+#ifdef _WIN32
+static void write_lines(std::vector<Pending_Output> &batch)
+{
+	for (auto &p : batch)
+		fwrite(p.line.data(), 1, p.line.size(), stdout);
+	fflush(stdout);
+}
+#else
+static void write_lines(std::vector<Pending_Output> &batch)
+{
+	size_t i = 0, offset = 0;
+	while (i < batch.size()) {
+		iovec iov[64];
+		int n = 0;
+		for (size_t k = i; k < batch.size() && n < 64; k++, n++) {
+			size_t skip = k == i ? offset : 0;
+			iov[n].iov_base = batch[k].line.data() + skip;
+			iov[n].iov_len = batch[k].line.size() - skip;
+		}
+		ssize_t written = writev(STDOUT_FILENO, iov, n);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ipc write");
+			return;
+		}
+		while (written > 0) {
+			size_t rest = batch[i].line.size() - offset;
+			if ((size_t)written < rest) {
+				offset += written;
+				break;
+			}
+			written -= rest;
+			offset = 0;
+			i++;
+		}
+	}
+}
+#endif
+
+static void output_thread()
+{
+	std::vector<Pending_Output> batch;
+	std::unique_lock<std::mutex> lock(output->lock);
+	while (1) {
+		output->cond.wait(lock, [] { return !output->queue.empty(); });
+		batch.swap(output->queue);
+		output->writing = true;
+		lock.unlock();
+
+		write_lines(batch);
+
+		lock.lock();
+		output->stats.written += batch.size();
+		output->writing = false;
+		batch.clear();
+		output->cond.notify_all();
+	}
+}
+
+// Gives queued messages a moment to reach the pipe when the process exits,
+// e.g. the last control message before close.
+static void flush_output()
+{
+	std::unique_lock<std::mutex> lock(output->lock);
+	output->cond.wait_for(lock, std::chrono::milliseconds(200),
+		[] { return output->queue.empty() && !output->writing; });
+}
+
+static void start_output_thread()
+{
+	output = new Output_State;
+	std::thread(output_thread).detach();
+	atexit(flush_output);
+}
+
+bool ipc_send(const nlohmann::json &msg, Output_Kind kind)
+{
+	static std::once_flag started;
+	std::call_once(started, start_output_thread);
+
+	Pending_Output out;
+	auto type = msg.find("type");
+	if (type != msg.end() && type->is_string())
+		out.type = type->get<std::string>();
+	out.line = msg.dump();
+	out.line += '\n';
+
+	{
+		std::lock_guard<std::mutex> guard(output->lock);
+		auto &queue = output->queue;
+		bool replaced = false;
+		if (kind == OUTPUT_SUPERSEDE) {
+			for (auto &p : queue) {
+				if (p.type == out.type) {
+					p = std::move(out);
+					output->stats.superseded++;
+					replaced = true;
+					break;
+				}
+			}
+		}
+		if (!replaced) {
+			if (kind == OUTPUT_DROPPABLE && queue.size() >= max_pending_output) {
+				output->stats.dropped++;
+				return false;
+			}
+			queue.push_back(std::move(out));
+			output->stats.peak_depth = std::max(output->stats.peak_depth, queue.size());
+		}
+	}
+	output->cond.notify_all();
+	return true;
+}
+
+Output_Stats take_output_stats()
+{
+	if (output == nullptr)
+		return {};
+	std::lock_guard<std::mutex> guard(output->lock);
+	Output_Stats s = output->stats;
+	output->stats = {};
+	return s;
+}
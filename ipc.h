@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+#include "json.h"
+
+// Commands of the stdin protocol, one JSON object per line. String fields
+// are views into the Input_Line they were parsed from and stay valid until
+// that line is reused.
+
+struct Pause_Cmd {
+	bool paused;
+};
+
+struct Seek_Cmd {
+	double time;
+};
+
+struct Message_Cmd {
+	std::string_view message;
+	std::string_view fg_color, bg_color;
+};
+
+struct Add_File_Cmd {
+	std::string_view file_path;
+};
+
+// Either a list of files or a playlist file, or both.
+struct Add_Files_Cmd {
+	std::vector<std::string_view> files;
+	std::string_view playlist;
+	int64_t request_id = -1;
+};
+
+struct Playlist_Clear_Cmd {
+};
+
+struct Set_Playlist_Position_Cmd {
+	int64_t position;
+};
+
+struct Set_Canonical_Cmd {
+	int64_t playlist_position;
+	bool paused;
+	double time;
+};
+
+struct Request_Status_Cmd {
+	int64_t request_id;
+};
+
+struct Request_Stats_Cmd {
+	int64_t request_id;
+};
+
+struct Subscribe_Status_Cmd {
+	double max_rate = 10;
+	double heartbeat = 0;
+};
+
+struct Unsubscribe_Status_Cmd {
+};
+
+struct Set_Property_Cmd {
+	std::string_view property;
+	std::string_view value;
+};
+
+// Writes a Chrome trace of the last seconds to path, or to a file in the
+// temporary directory if path is empty.
+struct Dump_Trace_Cmd {
+	double seconds = 10;
+	std::string_view path;
+	int64_t request_id = -1;
+};
+
+// Looks up what the resolver worker makes of a web URL, answered with a
+// resolved message.
+struct Resolve_Cmd {
+	std::string_view url;
+	int64_t request_id = -1;
+};
+
+struct Close_Cmd {
+};
+
+// std::monostate is a line without a type we know, which is ignored.
+using Ipc_Command = std::variant<std::monostate, Pause_Cmd, Seek_Cmd,
+	Message_Cmd, Add_File_Cmd, Add_Files_Cmd, Playlist_Clear_Cmd, Set_Playlist_Position_Cmd,
+	Set_Canonical_Cmd, Request_Status_Cmd, Request_Stats_Cmd,
+	Subscribe_Status_Cmd, Unsubscribe_Status_Cmd, Set_Property_Cmd,
+	Dump_Trace_Cmd, Resolve_Cmd, Close_Cmd>;
+
+struct Input_Line {
+	std::string text;
+	// Only used for lines the fast parser does not handle; cmd then points
+	// into its strings instead of into text.
+	nlohmann::json fallback;
+	Ipc_Command cmd;
+};
+
+// Decodes line.text into line.cmd. Known commands are decoded directly from
+// the text, unescaping strings in place; anything else goes through
+// nlohmann::json. Throws on malformed input like json::parse does.
+void parse_command(Input_Line &line);
+
+// How a message is queued when the client is not keeping up.
+enum Output_Kind {
+	// Always queued, over the cap if need be: replies a client waits for
+	// and user input.
+	OUTPUT_RELIABLE,
+	// Replaces a queued message of the same type that has not been written
+	// yet; for state where only the latest matters.
+	OUTPUT_SUPERSEDE,
+	// Dropped and counted when the queue is full. The sender has to make
+	// up for it, e.g. with a full update next time.
+	OUTPUT_DROPPABLE,
+};
+
+// Messages to the client are serialized on the calling thread and written
+// to stdout by a dedicated thread, so a slow reader on the other end of the
+// pipe never blocks the caller. Queued messages are flushed together with
+// writev. Returns false if the message was dropped.
+bool ipc_send(const nlohmann::json &msg, Output_Kind kind = OUTPUT_RELIABLE);
+
+struct Output_Stats {
+	uint64_t written;
+	uint64_t superseded;
+	uint64_t dropped;
+	size_t peak_depth;
+};
+
+// Returns the counters since the previous call and resets them.
+Output_Stats take_output_stats();
@@ -0,0 +1,118 @@
+// Compares stdin command decoding throughput of parse_command against the
+// previous path of building a full nlohmann::json document per line and
+// copying the fields out of it.
+//
+// make bench
+
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "ipc.h"
+
+using json = nlohmann::json;
+
+static std::vector<std::string> make_corpus(int n)
+{
+	const char *lines[] = {
+		R"({"type": "message", "bg_color": "#000000BB", "fg_color": "#F0CF89", "message": "that was a great scene"})",
+		R"({"type": "message", "bg_color": "#000000BB", "fg_color": "#89CFF0", "message": "lol \"what\" é😀 ok\nnext line"})",
+		R"({"type": "message", "bg_color": "#000000BB", "fg_color": "#F0CF89", "message": "bot: 2/14 playing 1:23:45 - some fairly long status line repeated by a bot every few seconds"})",
+		R"({"type": "pause", "paused": true})",
+		R"({"type": "seek", "time": 5940.25})",
+		R"({"type": "set_canonical", "playlist_position": 1, "paused": false, "time": 1234.5})",
+		R"({"type": "request_status", "request_id": 42})",
+		R"({"type": "set_property", "property": "ui_bg_color", "value": "#000000BB"})",
+		R"({"type": "add_file", "file_path": "/home/user/videos/Some Show/S01E01 - Pilot.mkv"})",
+		R"({"type": "message", "bg_color": "#000000BB", "fg_color": "#F0CF89", "message": "short"})",
+	};
+	std::vector<std::string> corpus;
+	for (int i = 0; i < n; i++)
+		corpus.push_back(lines[i % (sizeof(lines) / sizeof(*lines))]);
+	return corpus;
+}
+
+// What handle_instruction used to extract from the document.
+static size_t json_path(const std::string &line)
+{
+	json j = json::parse(line);
+	auto &type = j.at("type");
+	size_t sink = 0;
+	if (type == "message") {
+		std::string bg = j.at("bg_color"), fg = j.at("fg_color"), msg = j.at("message");
+		sink += bg.size() + fg.size() + msg.size();
+	} else if (type == "pause") {
+		bool paused = j.at("paused");
+		sink += paused;
+	} else if (type == "seek") {
+		double time = j.at("time");
+		sink += time;
+	} else if (type == "set_canonical") {
+		int64_t pos = j.at("playlist_position");
+		bool paused = j.at("paused");
+		double time = j.at("time");
+		sink += pos + paused + time;
+	} else if (type == "request_status") {
+		int id = j.at("request_id");
+		sink += id;
+	} else if (type == "set_property") {
+		std::string prop = j.at("property"), v = j.at("value");
+		sink += prop.size() + v.size();
+	} else if (type == "add_file") {
+		std::string path = j.at("file_path");
+		sink += path.size();
+	}
+	return sink;
+}
+
+static size_t fast_path(Input_Line &line, const std::string &text)
+{
+	line.text = text;
+	parse_command(line);
+	return line.cmd.index();
+}
+
+template <typename F>
+static double run(const char *name, const std::vector<std::string> &corpus, int rounds, F f)
+{
+	size_t sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++)
+		for (auto &l : corpus)
+			sink += f(l);
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double rate = corpus.size() * rounds / secs;
+	printf("%-24s %12.0f commands/s  (sink %zu)\n", name, rate, sink);
+	return rate;
+}
+
+static bool same_message(const std::string &text)
+{
+	Input_Line fast, slow;
+	fast.text = slow.text = text;
+	parse_command(fast);
+	slow.fallback = json::parse(text);
+	auto *a = std::get_if<Message_Cmd>(&fast.cmd);
+	if (a == nullptr || !fast.fallback.is_null())
+		return false;
+	return a->message == slow.fallback.at("message").get<std::string>()
+		&& a->fg_color == slow.fallback.at("fg_color").get<std::string>()
+		&& a->bg_color == slow.fallback.at("bg_color").get<std::string>();
+}
+
+int main()
+{
+	auto corpus = make_corpus(10000);
+	for (int i = 0; i < 3; i++) {
+		if (!same_message(corpus[i])) {
+			fprintf(stderr, "fast parser disagrees with nlohmann on: %s\n", corpus[i].c_str());
+			return 1;
+		}
+	}
+
+	Input_Line line;
+	double before = run("nlohmann::json", corpus, 20, json_path);
+	double after = run("parse_command", corpus, 20, [&](const std::string &l) { return fast_path(line, l); });
+	printf("speedup: %.1fx\n", after / before);
+	return 0;
+}
@@ -8,26 +8,124 @@
 #include <vector>
 #include <string>
 #include <iostream>
-#include <sstream>
-#include <mutex>
-#include <queue>
 #include <string_view>
 #include <charconv>
 #include <algorithm>
 #include <filesystem>
 #include <thread>
+#include <atomic>
 
 #include "imgui/imgui.h"
 #include "imgui/imgui_impl_sdl.h"
 #include "imgui/imgui_impl_opengl3.h"
 #include "moov.h"
 #include "ui.h"
+#include "ring.h"
+#include "triple.h"
+#include "fixed_text.h"
+#include "ipc.h"
+#include "resolver.h"
+#include "thumbnails.h"
+#include "trace.h"
+#include "alloc_count.h"
 #include "json.h"
 
 using json = nlohmann::json;
+using Input_Ring = Spsc_Ring<Input_Line, 256>;
 
 ImFont *text_font;
 ImFont *icon_font;
+Stats stats;
+
+// Chat messages start fading out this long after they arrive and are gone
+// after the fade duration.
+constexpr double chat_fade_delay = 12.0;
+constexpr double chat_fade_duration = 3.0;
+// How many chat messages may be laid out in one frame. A burst of long
+// messages is spread over several frames instead of making one slow.
+constexpr int chat_layout_budget = 4;
+
+// How often the control thread runs the drift controller during playback,
+// in seconds.
+constexpr double control_interval = 0.01;
+
+// Playback actions from the UI. They are carried out on the control thread,
+// against the player state there rather than the snapshot the UI drew.
+enum Ui_Action {
+	UI_PREVIOUS,
+	UI_NEXT,
+	UI_TOGGLE_PAUSE,
+	UI_FORCE_SYNC,
+	UI_CANONIZE,
+	UI_NEXT_AUDIO,
+	UI_NEXT_SUB,
+	UI_TOGGLE_MUTE,
+	UI_EXPLORE, // arg is the offset from the canonical time
+	UI_EXPLORE_CANCEL,
+	UI_EXPLORE_ACCEPT,
+	UI_WINDOW_HIDDEN,
+	UI_WINDOW_SHOWN,
+	UI_PREVIEW_READY, // the preview has a render context
+};
+
+struct Ui_Command {
+	Ui_Action action;
+	double arg;
+};
+
+// Changes to state owned by the render thread, from IPC commands handled
+// on the control thread.
+struct Render_Update {
+	enum Kind { CHAT_MESSAGE, SET_COLOR } kind;
+	Message message;
+	uint32_t Configuration::*color;
+	uint32_t value;
+};
+
+// How the render thread, the control thread and the stdin reader talk to
+// each other. The control thread owns the Player; the other threads only
+// call its wakeup().
+struct Control_Channels {
+	Player *player;
+	Input_Ring input;
+	Spsc_Ring<Ui_Command, 64> ui;
+	Spsc_Ring<Render_Update, 256> render;
+	Triple_Buffer<PlayerInfo> info;
+};
+
+// Without a window (--headless) there is no SDL, GL or ImGui. The protocol
+// and the player work as usual, and video is either dropped or rendered
+// into memory so its cost still shows up in benchmarks.
+enum Headless_Mode {
+	HEADLESS_OFF,
+	HEADLESS_NULL,
+	HEADLESS_SW
+};
+
+Headless_Mode headless = HEADLESS_OFF;
+
+// Set by the input thread at the end of stdin. Only headless runs exit on
+// it; a window stays open until it is closed.
+std::atomic<bool> input_closed = false;
+
+// Posted to the SDL queue from other threads to wake the main loop. Only
+// one is kept in flight; the main loop clears the flag when it sees it.
+// Without SDL the main loop waits on the flag itself.
+uint32_t wake_event;
+std::atomic<bool> wake_pending = false;
+
+void wake_main(void * /*ctx*/ = nullptr)
+{
+	if (wake_pending.exchange(true))
+		return;
+	if (headless != HEADLESS_OFF) {
+		wake_pending.notify_one();
+		return;
+	}
+	SDL_Event e = {};
+	e.type = wake_event;
+	SDL_PushEvent(&e);
+}
 
 void *get_proc_address_mpv(void *fn_ctx, const char *name)
 {
@@ -35,7 +133,65 @@ void *get_proc_address_mpv(void *fn_ctx, const char *name)
 }
 
 void on_mpv_redraw(void *mpv_redraw)
-{ 
+{
+	wake_main();
+}
+
+// Renders a frame of ctx into fbo, which is w by h. The window's own
+// framebuffer (0) is upside down to mpv.
+void render_video(mpv_render_context *ctx, int fbo, int w, int h)
+{
+	mpv_opengl_fbo mpfbo{ fbo, w, h, 0 };
+	int flip_y = fbo == 0;
+
+	int block = 0;
+
+	mpv_render_param params[] = {
+		{ MPV_RENDER_PARAM_OPENGL_FBO, &mpfbo },
+		{ MPV_RENDER_PARAM_FLIP_Y, &flip_y },
+#ifndef __linux__
+		{ MPV_RENDER_PARAM_BLOCK_FOR_TARGET_TIME, &block },
+#endif
+		{ MPV_RENDER_PARAM_INVALID, nullptr }
+	};
+	TRACE_SCOPE("mpv_render_context_render");
+	mpv_render_context_render(ctx, params);
+}
+
+// Where the canonical video goes while explore mode has the window: an
+// offscreen target, copied into the top right corner after rendering.
+struct Pip_Target {
+	GLuint fbo = 0, texture = 0;
+	int w = 0, h = 0;
+};
+
+void render_pip(Pip_Target &t, mpv_render_context *ctx, int win_w, int win_h)
+{
+	int w = win_w / 4, h = win_h / 4, margin = win_h / 40;
+	if (t.fbo == 0) {
+		glGenFramebuffers(1, &t.fbo);
+		glGenTextures(1, &t.texture);
+	}
+	if (t.w != w || t.h != h) {
+		t.w = w;
+		t.h = h;
+		glBindTexture(GL_TEXTURE_2D, t.texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, t.fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t.texture, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	// Flipped here rather than by mpv, so the copy is the right way up.
+	render_video(ctx, t.fbo, w, h);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, t.fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, h, w, 0, win_w - w - margin, win_h - h - margin, win_w - margin, win_h - margin,
+		GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
 void toggle_fullscreen(SDL_Window *win, UI_State &ui)
@@ -47,11 +203,84 @@ void toggle_fullscreen(SDL_Window *win, UI_State &ui)
 	ui.fullscreen = SDL_GetWindowFlags(win) & SDL_WINDOW_FULLSCREEN_DESKTOP;
 }
 
-void move_window(SDL_Window *win, int dx, int dy)
+// What the hit test needs to know about the UI, as of the last frame.
+struct Hit_Test_State {
+	ImRect ui_bg, chat_input;
+	bool fullscreen = false;
+};
+
+Hit_Test_State hit_test_state;
+
+Thumbnailer thumbnailer;
+Thumbnail_Atlas thumbnail_atlas;
+
+// Thumbnail times are rounded to about a hundredth of the seek bar, so
+// moving the mouse by a few pixels does not ask for another one.
+double thumbnail_step(const UI_State &ui)
 {
-	int x, y;
-	SDL_GetWindowPosition(win, &x, &y);
-	SDL_SetWindowPosition(win, x + dx, y + dy);
+	return std::max(1.0, std::round(ui.seek_bar_scale / 100));
+}
+
+double thumbnail_time(const UI_State &ui, double time)
+{
+	double step = thumbnail_step(ui);
+	return std::round(time / step) * step;
+}
+
+// Draws the thumbnail of time above the seek bar at x, or asks for it.
+void seek_bar_thumbnail(const UI_State &ui, const PlayerInfo &info, const Layout &l, float x, double time)
+{
+	if (info.media_path.empty() || time < 0 || (info.duration > 0 && time > info.duration))
+		return;
+	thumbnailer.set_file(info.media_path, info.media_headers, wake_main);
+	time = thumbnail_time(ui, time);
+
+	ImTextureID texture;
+	ImVec2 uv0, uv1;
+	if (!thumbnail_atlas.find(thumbnailer.file(), time, texture, uv0, uv1)) {
+		thumbnailer.want(time, true);
+		return;
+	}
+	ImVec2 size(Thumbnailer::width, Thumbnailer::height);
+	ImVec2 pos(x - size.x / 2, l.seek_bar.pos.y - size.y - l.minor_padding.y);
+	pos.x = std::clamp(pos.x, l.seek_bar.pos.x, l.seek_bar.pos.x + l.seek_bar.size.x - size.x);
+	ImGui::GetWindowDrawList()->AddImage(texture, pos, pos + size, uv0, uv1);
+}
+
+// Once thumbnails are in use, asks for a few around the playback position
+// whenever it moves on, so they are there before the mouse is.
+void thumbnail_strip(UI_State &ui, const PlayerInfo &info)
+{
+	if (!thumbnailer.started() || info.media_path.empty())
+		return;
+	thumbnailer.set_file(info.media_path, info.media_headers, wake_main);
+	double now = thumbnail_time(ui, info.c_time);
+	if (now == ui.thumbnail_strip_time)
+		return;
+	ui.thumbnail_strip_time = now;
+
+	double spacing = 5 * thumbnail_step(ui);
+	ImTextureID texture;
+	ImVec2 uv0, uv1;
+	for (int k : { 1, -1, 2, -2, 4, 8 }) {
+		double t = now + k * spacing;
+		if (t < 0 || (info.duration > 0 && t > info.duration))
+			continue;
+		if (!thumbnail_atlas.find(thumbnailer.file(), t, texture, uv0, uv1))
+			thumbnailer.want(t, false);
+	}
+}
+
+// Lets the window manager move the window when it is dragged by any part
+// the UI does not cover, so dragging takes no frames of our own. Called
+// while SDL processes events, i.e. on the render thread.
+SDL_HitTestResult hit_test(SDL_Window * /*win*/, const SDL_Point *area, void *data)
+{
+	auto &s = *static_cast<Hit_Test_State *>(data);
+	ImVec2 p(area->x, area->y);
+	if (s.fullscreen || intersects_rect(p, s.ui_bg) || intersects_rect(p, s.chat_input))
+		return SDL_HITTEST_NORMAL;
+	return SDL_HITTEST_DRAGGABLE;
 }
 
 void send_control(int64_t pos, double time, bool paused)
@@ -61,20 +290,61 @@ void send_control(int64_t pos, double time, bool paused)
 	res["playlist_position"] = pos;
 	res["time"] = time;
 	res["paused"] = paused;
-	std::cout << res << std::endl;
+	ipc_send(res, OUTPUT_SUPERSEDE);
+}
+
+void send_add_files_done(int64_t request_id, int64_t added, int64_t failed, double elapsed)
+{
+	json res;
+	res["type"] = "add_files_done";
+	if (request_id >= 0)
+		res["request_id"] = request_id;
+	res["added"] = added;
+	res["failed"] = failed;
+	res["elapsed"] = elapsed;
+	ipc_send(res);
+}
+
+void send_resolved(int64_t request_id, const Resolved &r)
+{
+	json res;
+	res["type"] = "resolved";
+	if (request_id >= 0)
+		res["request_id"] = request_id;
+	res["url"] = r.url;
+	res["ok"] = r.ok;
+	if (r.ok) {
+		res["title"] = r.title;
+		res["uploader"] = r.uploader;
+		res["uploader_url"] = r.uploader_url;
+		res["duration"] = r.duration;
+	} else {
+		res["error"] = r.error;
+	}
+	ipc_send(res);
 }
 
-void read_input(std::mutex &m, std::queue<json> &q)
+void read_input(Control_Channels &ch)
 {
-	std::string l;
-	while (std::getline(std::cin, l))
+	Input_Ring &q = ch.input;
+	while (1)
 	{
-		std::lock_guard<std::mutex> g(m);
+		Input_Line *slot;
+		while ((slot = q.write_slot()) == nullptr)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		if (!std::getline(std::cin, slot->text)) {
+			input_closed = true;
+			ch.player->wakeup();
+			break;
+		}
 		try {
-			q.push(json::parse(l));
+			parse_command(*slot);
 		} catch (std::exception &e) {
 			std::cerr << e.what() << std::endl;	
+			continue;
 		}
+		q.commit();
+		ch.player->wakeup();
 	}
 }
 
@@ -94,106 +364,407 @@ uint32_t decode_color(std::string_view string)
 	return *(uint32_t *)channels;
 }
 
-void handle_instruction(Player &p, Chat &c, Configuration &conf, json &j)
+// Whether the window is hidden, as far as the control thread knows, and
+// since when it has been accounted for.
+struct Visibility {
+	bool hidden = false;
+	time_point mark = std::chrono::steady_clock::now();
+	std::clock_t mark_cpu = std::clock();
+};
+
+Visibility visibility;
+
+// Adds the time and CPU time since the last call to the totals for the
+// window being shown or hidden. While hidden, the CPU time saved is what
+// the rate while shown would have used minus what was used.
+void account_visibility()
 {
-	auto type_it = j.find("type");
-	if (type_it == j.end())
-		return;
+	auto &v = visibility;
+	auto now = std::chrono::steady_clock::now();
+	auto cpu = std::clock();
+	double wall = std::chrono::duration<double>(now - v.mark).count();
+	double cpu_time = (double)(cpu - v.mark_cpu) / CLOCKS_PER_SEC;
+	v.mark = now;
+	v.mark_cpu = cpu;
+
+	if (!v.hidden) {
+		stats.shown_time += wall;
+		stats.shown_cpu += cpu_time;
+	} else {
+		stats.hidden_time += wall;
+		if (stats.shown_time > 0)
+			stats.hidden_cpu_saved += std::max(0.0, wall * stats.shown_cpu / stats.shown_time - cpu_time);
+	}
+}
+
+// The render thread is woken up once per control loop iteration if there
+// are updates. If it has fallen this far behind, updates are dropped rather
+// than stalling the control thread.
+Render_Update *render_update_slot(Control_Channels &ch)
+{
+	Render_Update *u = ch.render.write_slot();
+	if (u == nullptr)
+		stats.render_updates_dropped++;
+	return u;
+}
 
-	auto &type = *type_it;
-	if (type == "pause")
+void handle_instruction(Player &p, Control_Channels &ch, Status_Subscription &status, Chat_Ingest &chat,
+	const Ipc_Command &cmd)
+{
+	if (auto pause = std::get_if<Pause_Cmd>(&cmd))
 	{
-		bool paused = j.at("paused");
-		p.pause(paused);
+		p.pause(pause->paused);
 	}
-	else if (type == "seek")
+	else if (auto seek = std::get_if<Seek_Cmd>(&cmd))
 	{
-		double time = j.at("time");
-		p.set_time(time);
+		p.set_time(seek->time);
 	}
-	else if (type == "message")
+	else if (auto msg = std::get_if<Message_Cmd>(&cmd))
 	{
-		std::string bg_str = j.at("bg_color");
-		std::string fg_str = j.at("fg_color");
-		std::string msg = j.at("message");
-		c.add_message({
-			msg,
-			std::chrono::steady_clock::now(),
-			decode_color(fg_str),
-			decode_color(bg_str)
-		});
-	}
-	else if (type == "add_file")
+		if (!chat.admit(std::chrono::steady_clock::now()))
+			chat.hold(msg->message, msg->fg_color, msg->bg_color);
+		else if (Render_Update *u = render_update_slot(ch)) {
+			u->kind = Render_Update::CHAT_MESSAGE;
+			u->message.text.assign(msg->message);
+			u->message.time = std::chrono::steady_clock::now();
+			u->message.fg = decode_color(msg->fg_color);
+			u->message.bg = decode_color(msg->bg_color);
+			ch.render.commit();
+		}
+	}
+	else if (auto add = std::get_if<Add_File_Cmd>(&cmd))
 	{
-		std::string path = j.at("file_path");
-		p.add_file(path.c_str());
+		p.add_file(add->file_path.data());
 	}
-	else if (type == "playlist_clear")
+	else if (auto add = std::get_if<Add_Files_Cmd>(&cmd))
+	{
+		p.add_files(add->files, add->playlist, add->request_id);
+	}
+	else if (std::holds_alternative<Playlist_Clear_Cmd>(cmd))
 	{
 		p.playlist_clear();
 	}
-	else if (type == "set_playlist_position")
+	else if (auto pos = std::get_if<Set_Playlist_Position_Cmd>(&cmd))
 	{
-		int64_t pos = j.at("position");
-		p.set_pl_pos(pos);
+		p.set_pl_pos(pos->position);
 	}
-	else if (type == "set_canonical")
+	else if (auto canon = std::get_if<Set_Canonical_Cmd>(&cmd))
 	{
-		int64_t pos = j.at("playlist_position");
-		bool paused = j.at("paused");
-		double time = j.at("time");
-		p.set_canonical(pos, paused, time);
+		p.set_canonical(canon->playlist_position, canon->paused, canon->time);
 	}
-	else if (type == "request_status")
+	else if (auto req = std::get_if<Request_Status_Cmd>(&cmd))
 	{
-		int request_id = j.at("request_id");
-		auto info = p.get_info();
+		auto &info = p.get_info();
 		json res;
 		res["type"] = "status";
-		res["request_id"] = request_id;
+		res["request_id"] = req->request_id;
 		res["playlist_position"] = info.pl_pos;
 		res["playlist_count"] = info.pl_count;
 		res["time"] = info.c_time;
 		res["paused"] = info.c_paused;
 		res["delay"] = info.delay;
-		std::cout << res << std::endl;
+		ipc_send(res);
+	}
+	else if (auto req = std::get_if<Request_Stats_Cmd>(&cmd))
+	{
+		auto now = std::chrono::steady_clock::now();
+		auto cpu = std::clock();
+		double wall = std::chrono::duration<double>(now - stats.mark_time).count();
+		double cpu_time = (double)(cpu - stats.mark_cpu) / CLOCKS_PER_SEC;
+		json res;
+		res["type"] = "stats";
+		res["request_id"] = req->request_id;
+		res["interval"] = wall;
+		res["wakeups"] = stats.wakeups.load();
+		res["frames"] = stats.frames.load();
+		res["cpu_usage"] = wall > 0 ? cpu_time / wall : 0.0;
+		res["ipc_queue_peak"] = stats.ipc_queue_peak;
+		res["mpv_calls"] = stats.mpv_calls;
+		res["mpv_calls_peak"] = stats.mpv_calls_peak;
+		res["mpv_write_errors"] = stats.mpv_write_errors;
+		res["switches"] = stats.switches;
+		res["switch_time_avg"] = stats.switches ? stats.switch_time_total / stats.switches : 0.0;
+		res["switch_time_max"] = stats.switch_time_max;
+		res["prefetches"] = stats.prefetches;
+		res["render_updates_dropped"] = stats.render_updates_dropped;
+		account_visibility();
+		res["hidden_time"] = stats.hidden_time;
+		res["hidden_cpu_saved"] = stats.hidden_cpu_saved;
+		res["chat_collapsed"] = stats.chat_collapsed;
+		res["chat_layouts_deferred"] = stats.chat_layouts_deferred.load();
+		auto out = take_output_stats();
+		res["output_written"] = out.written;
+		res["output_superseded"] = out.superseded;
+		res["output_dropped"] = out.dropped;
+		res["output_queue_peak"] = out.peak_depth;
+		ipc_send(res);
+		stats.wakeups = 0;
+		stats.frames = 0;
+		stats.ipc_queue_peak = 0;
+		stats.render_updates_dropped = 0;
+		stats.hidden_time = stats.hidden_cpu_saved = 0;
+		stats.chat_collapsed = stats.chat_layouts_deferred = 0;
+		stats.mpv_calls = stats.mpv_calls_peak = stats.mpv_write_errors = 0;
+		stats.switches = 0;
+		stats.switch_time_total = stats.switch_time_max = 0;
+		stats.prefetches = 0;
+		stats.mark_time = now;
+		stats.mark_cpu = cpu;
+	}
+	else if (auto sub = std::get_if<Subscribe_Status_Cmd>(&cmd))
+	{
+		status.subscribe(sub->max_rate, sub->heartbeat);
+	}
+	else if (std::holds_alternative<Unsubscribe_Status_Cmd>(cmd))
+	{
+		status.unsubscribe();
 	}
-	else if (type == "set_property")
+	else if (auto set = std::get_if<Set_Property_Cmd>(&cmd))
 	{
-		auto prop = j.at("property");
-		std::string v = j.at("value");
+		auto prop = set->property;
+		auto v = set->value;
 		if (prop == "ytdl_format") {
-			p.set_ytdl_format(v.c_str());
-		} else if (prop == "ui_bg_color") {
-			conf.ui_bg_col = decode_color(v);
-		} else if (prop == "ui_text_color") {
-			conf.ui_text_col = decode_color(v);
-		} else if (prop == "button_color") {
-			conf.but_col = decode_color(v);
-		} else if (prop == "button_hovered_color") {
-			conf.but_hovered_col = decode_color(v);
-		} else if (prop == "button_pressed_color") {
-			conf.but_pressed_col = decode_color(v);
-		} else if (prop == "button_label_color") {
-			conf.but_label_col = decode_color(v);
-		} else if (prop == "seek_bar_bg_color") {
-			conf.seek_bar_bg_col = decode_color(v);
-		} else if (prop == "seek_bar_fg_inactive_color") {
-			conf.seek_bar_fg_inactive_col = decode_color(v);
-		} else if (prop == "seek_bar_fg_active_color") {
-			conf.seek_bar_fg_active_col = decode_color(v);
-		} else if (prop == "seek_bar_notch_color") {
-			conf.seek_bar_notch_col = decode_color(v);
-		} else if (prop == "seek_bar_text_color") {
-			conf.seek_bar_text_col = decode_color(v);
-		}
-	}
-	else if (type == "close")
+			p.set_ytdl_format(v.data());
+		} else if (prop == "sync_controller") {
+			if (!p.set_sync_controller(v))
+				std::cerr << "unknown sync controller " << v << std::endl;
+		} else if (prop == "trace") {
+			trace_set_enabled(v == "on");
+		}
+
+		uint32_t Configuration::*color = nullptr;
+		if (prop == "ui_bg_color")
+			color = &Configuration::ui_bg_col;
+		else if (prop == "ui_text_color")
+			color = &Configuration::ui_text_col;
+		else if (prop == "button_color")
+			color = &Configuration::but_col;
+		else if (prop == "button_hovered_color")
+			color = &Configuration::but_hovered_col;
+		else if (prop == "button_pressed_color")
+			color = &Configuration::but_pressed_col;
+		else if (prop == "button_label_color")
+			color = &Configuration::but_label_col;
+		else if (prop == "seek_bar_bg_color")
+			color = &Configuration::seek_bar_bg_col;
+		else if (prop == "seek_bar_fg_inactive_color")
+			color = &Configuration::seek_bar_fg_inactive_col;
+		else if (prop == "seek_bar_fg_active_color")
+			color = &Configuration::seek_bar_fg_active_col;
+		else if (prop == "seek_bar_notch_color")
+			color = &Configuration::seek_bar_notch_col;
+		else if (prop == "seek_bar_text_color")
+			color = &Configuration::seek_bar_text_col;
+		if (color != nullptr) {
+			if (Render_Update *u = render_update_slot(ch)) {
+				u->kind = Render_Update::SET_COLOR;
+				u->color = color;
+				u->value = decode_color(v);
+				ch.render.commit();
+			}
+		}
+	}
+	else if (auto dump = std::get_if<Dump_Trace_Cmd>(&cmd))
+	{
+		std::string path(dump->path);
+		if (path.empty())
+			path = (std::filesystem::temp_directory_path() / "moov-trace.json").string();
+		// Writing can take a while for a long trace, which the control
+		// thread cannot spare.
+		std::thread([path, seconds = dump->seconds, id = dump->request_id]() {
+			int64_t events = trace_dump(path, seconds);
+			json res;
+			res["type"] = "trace_dump";
+			if (id >= 0)
+				res["request_id"] = id;
+			res["path"] = path;
+			res["events"] = events;
+			if (events < 0)
+				res["error"] = "could not write trace";
+			ipc_send(res);
+		}).detach();
+	}
+	else if (auto res = std::get_if<Resolve_Cmd>(&cmd))
+	{
+		p.resolve(res->url, res->request_id);
+	}
+	else if (std::holds_alternative<Close_Cmd>(cmd))
 	{
 		die("closed by ipc");
 	}
 }
 
+void handle_ui_command(Player &p, const Ui_Command &c)
+{
+	auto &info = p.get_info();
+	switch (c.action) {
+	case UI_PREVIOUS:
+		p.set_pl_pos(info.pl_pos - 1);
+		send_control(info.pl_pos, info.c_time, info.c_paused);
+		break;
+	case UI_NEXT:
+		p.set_pl_pos(info.pl_pos + 1);
+		send_control(info.pl_pos, info.c_time, info.c_paused);
+		break;
+	case UI_TOGGLE_PAUSE:
+		p.pause(!info.c_paused);
+		send_control(info.pl_pos, info.c_time, info.c_paused);
+		break;
+	case UI_FORCE_SYNC:
+		p.force_sync();
+		break;
+	case UI_CANONIZE:
+		p.set_time(info.c_time - info.delay);
+		send_control(info.pl_pos, info.c_time, info.c_paused);
+		break;
+	case UI_NEXT_AUDIO:
+		if (int64_t id = next_track_id(info, TRACK_AUDIO, info.audio_pos))
+			p.set_audio(id);
+		break;
+	case UI_NEXT_SUB:
+		if (int64_t id = next_track_id(info, TRACK_SUB, info.sub_pos))
+			p.set_sub(id);
+		break;
+	case UI_TOGGLE_MUTE:
+		p.toggle_mute();
+		break;
+	case UI_EXPLORE:
+		if (!info.exploring)
+			p.explore();
+		p.set_explore_time(info.c_time + c.arg);
+		break;
+	case UI_EXPLORE_CANCEL:
+		p.explore_cancel();
+		break;
+	case UI_EXPLORE_ACCEPT:
+		p.explore_accept();
+		break;
+	case UI_WINDOW_HIDDEN:
+	case UI_WINDOW_SHOWN:
+		// Playback and syncing go on as usual, only without video.
+		account_visibility();
+		visibility.hidden = c.action == UI_WINDOW_HIDDEN;
+		p.set_video(!visibility.hidden);
+		break;
+	case UI_PREVIEW_READY:
+		p.preview_ready();
+		break;
+	}
+}
+
+// Whether the UI drawn from b would differ from the one drawn from a, going
+// by what it shows: times to the second and the delay rounded.
+bool looks_different(const PlayerInfo &a, const PlayerInfo &b)
+{
+	return a.pl_pos != b.pl_pos || a.pl_count != b.pl_count || a.muted != b.muted
+		|| a.title != b.title || a.audio_pos != b.audio_pos || a.audio_count != b.audio_count
+		|| a.sub_pos != b.sub_pos || a.sub_count != b.sub_count
+		|| a.c_paused != b.c_paused || std::floor(a.c_time) != std::floor(b.c_time)
+		|| std::round(a.delay) != std::round(b.delay)
+		|| a.exploring != b.exploring || a.e_paused != b.e_paused
+		|| std::floor(a.e_time) != std::floor(b.e_time);
+}
+
+// Runs the player: IPC and UI commands, mpv events and the drift
+// controller. It sleeps in mpv_wait_event until one of those needs it, but
+// during playback wakes at least every control_interval, so the controller
+// runs at a steady rate however long the render thread takes to draw or
+// swap. Every iteration publishes a PlayerInfo snapshot for the render
+// thread and wakes it when the UI would change.
+void control_loop(Control_Channels &ch)
+{
+	trace_thread_name("control");
+	Player &p = *ch.player;
+	Status_Subscription status;
+	Chat_Ingest chat;
+	PlayerInfo shown = p.get_info();
+	uint64_t iteration_calls = stats.mpv_calls;
+
+	while (1) {
+		double timeout = -1;
+		{
+			auto now = std::chrono::steady_clock::now();
+			auto &info = p.get_info();
+			if (!info.c_paused)
+				timeout = control_interval;
+			for (auto deadline : { status.next_update(now), chat.next_release(), p.prefetch_deadline(),
+				p.resolve_deadline() }) {
+				if (!deadline.has_value())
+					continue;
+				double t = std::max(0.0, std::chrono::duration<double>(*deadline - now).count());
+				if (timeout < 0 || t < timeout)
+					timeout = t;
+			}
+		}
+		p.wait(timeout);
+
+		stats.ipc_queue_peak = std::max(stats.ipc_queue_peak, ch.input.depth());
+		{
+			TRACE_SCOPE("ipc_commands");
+			// Read before draining: once it is set, no more lines follow.
+			bool closed = input_closed;
+			while (Input_Line *line = ch.input.read_slot())
+			{
+				handle_instruction(p, ch, status, chat, line->cmd);
+				ch.input.release();
+			}
+			if (closed && headless != HEADLESS_OFF)
+				exit(EXIT_SUCCESS);
+			// If the render thread is behind, held messages just wait.
+			auto now = std::chrono::steady_clock::now();
+			while (Render_Update *u = ch.render.write_slot()) {
+				if (!chat.take_held(now, u->message))
+					break;
+				u->kind = Render_Update::CHAT_MESSAGE;
+				ch.render.commit();
+			}
+		}
+		{
+			TRACE_SCOPE("ui_commands");
+			while (Ui_Command *c = ch.ui.read_slot())
+			{
+				handle_ui_command(p, *c);
+				ch.ui.release();
+			}
+		}
+
+		{
+			TRACE_SCOPE("player_update");
+			p.update();
+		}
+		{
+			TRACE_SCOPE("status_update");
+			status.update(p.get_info(), std::chrono::steady_clock::now());
+		}
+		p.flush_writes();
+		// request_stats may have reset the counter in between.
+		if (stats.mpv_calls >= iteration_calls)
+			stats.mpv_calls_peak = std::max(stats.mpv_calls_peak, stats.mpv_calls - iteration_calls);
+		iteration_calls = stats.mpv_calls;
+
+		auto &info = p.get_info();
+		ch.info.back() = info;
+		ch.info.publish();
+		if (looks_different(shown, info) || ch.render.depth() > 0) {
+			shown = info;
+			wake_main();
+		}
+	}
+}
+
+bool ui_command(Control_Channels &ch, Ui_Action action, double arg = 0)
+{
+	// Only full if the control thread is stuck, in which case the click is
+	// lost like any other.
+	Ui_Command *c = ch.ui.write_slot();
+	if (c == nullptr)
+		return false;
+	*c = { action, arg };
+	ch.ui.commit();
+	ch.player->wakeup();
+	return true;
+}
+
 void rect(ImRect rect, uint32_t color)
 {
 	ImGui::GetWindowDrawList()->AddRectFilled(rect.pos, rect.pos + rect.size, color);
@@ -230,51 +801,50 @@ bool button(Configuration &conf, UI_State &ui, Frame_Input &in, ImRect r, ImVec2
 	return click;
 }
 
-void chatbox(Chat &c, UI_State &ui, Layout &l)
+void chatbox(Chat &c, UI_State &ui, const Layout &l)
 {
 	auto draw_list = ImGui::GetWindowDrawList();
 
 	ImVec2 message_pos = l.chat_log.pos;
 	message_pos.y = l.chat_log.pos.y + l.chat_log.size.y;
-	auto messages = c.messages();
 
 	auto e = c.get_last_end_scroll_time();
 	auto n = std::chrono::steady_clock::now();
-	for (int i = messages.second - 1; i >= 0; i--)
+	int layout_budget = chat_layout_budget;
+	ui.chat_layout_pending = false;
+	for (size_t i = c.end(); i-- > 0;)
 	{
-		auto &msg = messages.first[i];
+		Chat_Message *p = c.message(i);
+		if (p == nullptr)
+			break;
+		auto &msg = *p;
 
 		double opacity;
 		{
-			double K = 12.0;
-			double F = 3.0;
 			auto m = msg.time;
 			double x = std::chrono::duration<double>(n-std::max(m, e)).count();
-			opacity = 1.0 - std::min(std::max(0.0, (x-K)/F), 1.0);
+			opacity = 1.0 - std::min(std::max(0.0, (x - chat_fade_delay) / chat_fade_duration), 1.0);
 		}
 
 		if (opacity == 0)
 			break;
 
 		auto padding = l.text_height / 4;
-		auto text_size = ImGui::CalcTextSize(msg.text.c_str(), nullptr, false, l.chat_log.size.x);
+		if (!message_geometry_current(msg, l.chat_log.size.x, padding)) {
+			// Older messages wait for the next frame.
+			if (layout_budget == 0) {
+				ui.chat_layout_pending = true;
+				stats.chat_layouts_deferred++;
+				break;
+			}
+			layout_budget--;
+		}
+		auto text_size = message_text_size(msg, l.chat_log.size.x);
 		message_pos.y -= text_size.y + padding * 3;
-		auto text_pos = ImVec2(message_pos.x + padding, message_pos.y + padding);
 		if (message_pos.y < l.chat_log.pos.y)
 			break;
 
-		auto fade_color = [](uint32_t col, double factor) {
-			uint32_t alpha = col >> 24;
-			uint32_t scaled_alpha = std::round(factor * alpha);
-			return (col & 0x00FFFFFF) | (scaled_alpha << 24);
-		};
-
-		uint32_t fg = fade_color(msg.fg, opacity*opacity);
-		uint32_t bg = fade_color(msg.bg, opacity);
-
-		ImVec2 rect_p_max(message_pos.x + text_size.x + padding * 2, message_pos.y + text_size.y + padding * 2);
-		draw_list->AddRectFilled(message_pos, rect_p_max, bg, 10);
-		draw_list->AddText(nullptr, 0.0f, text_pos, fg, msg.text.c_str(), msg.text.c_str() + msg.text.size(), l.chat_log.size.x, nullptr);
+		draw_message(draw_list, msg, message_pos, l.chat_log.size.x, padding, opacity*opacity, opacity);
 	}
 
 	static std::array<char, 1024> buf;
@@ -287,7 +857,7 @@ void chatbox(Chat &c, UI_State &ui, Layout &l)
 			json j;
 			j["type"] = "user_input";
 			j["text"] = buf.data();
-			std::cout << j << std::endl;
+			ipc_send(j);
 		}
 		buf[0] = '\0';
 	}
@@ -295,10 +865,9 @@ void chatbox(Chat &c, UI_State &ui, Layout &l)
 	ImGui::SetKeyboardFocusHere(-1);
 }
 
-void create_ui(SDL_Window *sdl_win, Configuration &conf, UI_State &ui, Frame_Input &in, Player &p, Layout &l, Chat &c)
+void create_ui(SDL_Window *sdl_win, Configuration &conf, UI_State &ui, Frame_Input &in, const PlayerInfo &info,
+	Control_Channels &ch, const Layout &l, Chat &c)
 {
-	auto info = p.get_info();
-
 	if (in.left_click && !ui.initial_left_down.has_value())
 		ui.initial_left_down = in.mouse_state;
 
@@ -322,37 +891,32 @@ void create_ui(SDL_Window *sdl_win, Configuration &conf, UI_State &ui, Frame_Inp
 	bool display_ui = (intersects_rect(in.mouse_state.pos, l.ui_bg) && in.mouse_state.in_window)
 		|| std::chrono::steady_clock::now() - ui.last_activity < std::chrono::seconds(2);
 
+	ui.display_ui = display_ui;
+
 	if (ui.fullscreen && !display_ui)
 		ImGui::SetMouseCursor(ImGuiMouseCursor_None);
 
 	if (display_ui)
 	{
+		thumbnail_strip(ui, info);
 		rect(l.ui_bg, conf.ui_bg_col);
 
-		if (button(conf, ui, in, l.prev_but, l.minor_padding, icon_font, PLAYLIST_PREVIOUS_ICON)) {
-			p.set_pl_pos(info.pl_pos - 1);
-			info = p.get_info();
-			send_control(info.pl_pos, info.c_time, info.c_paused);
-		}
+		if (button(conf, ui, in, l.prev_but, l.minor_padding, icon_font, PLAYLIST_PREVIOUS_ICON))
+			ui_command(ch, UI_PREVIOUS);
 
-		std::stringstream pl_status;
+		Fixed_Text<48> pl_status;
 		pl_status << (info.pl_pos + 1) << "/" << info.pl_count;
-		text(l.pl_status, l.major_padding, conf.ui_text_col, text_font, pl_status.str().c_str());
+		text(l.pl_status, l.major_padding, conf.ui_text_col, text_font, pl_status.c_str());
 
-		if (button(conf, ui, in, l.next_but, l.minor_padding, icon_font, PLAYLIST_NEXT_ICON)) {
-			p.set_pl_pos(info.pl_pos + 1);
-			info = p.get_info();
-			send_control(info.pl_pos, info.c_time, info.c_paused);
-		}
+		if (button(conf, ui, in, l.next_but, l.minor_padding, icon_font, PLAYLIST_NEXT_ICON))
+			ui_command(ch, UI_NEXT);
 
 		auto pp_but_str = info.c_paused ? PLAY_ICON : PAUSE_ICON;
-		if (button(conf, ui, in, l.pp_but, l.major_padding, icon_font, pp_but_str)) {
-			p.pause(!info.c_paused);
-			info = p.get_info();
-			send_control(info.pl_pos, info.c_time, info.c_paused);
-		}
+		if (button(conf, ui, in, l.pp_but, l.major_padding, icon_font, pp_but_str))
+			ui_command(ch, UI_TOGGLE_PAUSE);
 
-		text(l.time, l.major_padding, conf.ui_text_col, text_font, sec_to_timestr(info.c_time).c_str());
+		char timestr[TIMESTR_SIZE];
+		text(l.time, l.major_padding, conf.ui_text_col, text_font, sec_to_timestr(timestr, info.c_time));
 		if (!info.exploring)
 		{
 			uint32_t delay = std::round(abs(info.delay));
@@ -371,44 +935,42 @@ void create_ui(SDL_Window *sdl_win, Configuration &conf, UI_State &ui, Frame_Inp
 			else if (ui.delay_indicator_sign && info.delay > 0.1)
 				ui.delay_indicator_sign = true;
 
-			std::stringstream indicator;
+			Fixed_Text<16> indicator;
 			indicator << (ui.delay_indicator_sign ? '+' : '-') << delay << unit;
 
-			ImVec2 text_size = calc_text_size(text_font, l.major_padding, indicator.str().c_str());
+			ImVec2 text_size = calc_text_size(text_font, l.major_padding, indicator.c_str());
 			ImRect indicator_rect = l.delay_indicator;
 			indicator_rect.pos.x += indicator_rect.size.x - text_size.x;
-			text(indicator_rect, l.major_padding, conf.ui_text_col, text_font, indicator.str().c_str());
+			text(indicator_rect, l.major_padding, conf.ui_text_col, text_font, indicator.c_str());
 		}
 
 		if (button(conf, ui, in, l.sync_but, l.major_padding, text_font, "Sync"))
 		{
-			p.force_sync();
+			ui_command(ch, UI_FORCE_SYNC);
 		}
 
 		if (button(conf, ui, in, l.canonize_but, l.major_padding, text_font, "Canonicalize"))
 		{
-			p.set_time(info.c_time - info.delay);
-			info = p.get_info();
-			send_control(info.pl_pos, info.c_time, info.c_paused);
+			ui_command(ch, UI_CANONIZE);
 		}
 
 		if (button(conf, ui, in, l.audio_but, l.major_padding))
-			p.set_audio(info.audio_pos + 1);
+			ui_command(ch, UI_NEXT_AUDIO);
 		text(l.audio_icon, l.minor_padding, conf.ui_text_col, icon_font, AUDIO_ICON);
-        std::stringstream audio_status;
+		Fixed_Text<48> audio_status;
 		audio_status << " " << info.audio_pos << "/" << info.audio_count;
-		text(l.audio_status, l.minor_padding, conf.ui_text_col, text_font, audio_status.str().c_str());
+		text(l.audio_status, l.minor_padding, conf.ui_text_col, text_font, audio_status.c_str());
 
 		if (button(conf, ui, in, l.sub_but, l.major_padding))
-			p.set_sub(info.sub_pos + 1);
+			ui_command(ch, UI_NEXT_SUB);
 		text(l.sub_icon, l.minor_padding, conf.ui_text_col, icon_font, SUBTITLE_ICON);
-        std::stringstream sub_status;
+		Fixed_Text<48> sub_status;
 		sub_status << " " << info.sub_pos << "/" << info.sub_count;
-		text(l.sub_status, l.minor_padding, conf.ui_text_col, text_font, sub_status.str().c_str());
+		text(l.sub_status, l.minor_padding, conf.ui_text_col, text_font, sub_status.c_str());
 
 		auto mute_str = info.muted ? MUTED_ICON : UNMUTED_ICON;
 		if (button(conf, ui, in, l.mute_but, l.major_padding, icon_font, mute_str))
-			p.toggle_mute();
+			ui_command(ch, UI_TOGGLE_MUTE);
 
 		auto fullscr_str = ui.fullscreen ? UNFULLSCREEN_ICON : FULLSCREEN_ICON;
 		if (button(conf, ui, in, l.fullscr_but, l.major_padding, icon_font, fullscr_str))
@@ -462,13 +1024,10 @@ void create_ui(SDL_Window *sdl_win, Configuration &conf, UI_State &ui, Frame_Inp
 			int point = mouse_rel_seek.x - zero_point;
 
 			float time = point / l.seek_bar.size.x * ui.seek_bar_scale;
-            std::stringstream indicator_text;
-			if (time < 0) {
-				indicator_text << "-" << sec_to_timestr(-std::round(time));
-			} else {
-				indicator_text << "+" << sec_to_timestr(std::round(time));
-			}
-			ImVec2 indicator_size = calc_text_size(text_font, ImVec2(0, 0), indicator_text.str().c_str());
+			char indicator_text[TIMESTR_SIZE + 1];
+			indicator_text[0] = time < 0 ? '-' : '+';
+			sec_to_timestr(indicator_text + 1, std::round(std::abs(time)));
+			ImVec2 indicator_size = calc_text_size(text_font, ImVec2(0, 0), indicator_text);
 
 			auto indicator_pos = ImVec2(in.mouse_state.pos.x, l.seek_bar.pos.y);
 
@@ -476,24 +1035,22 @@ void create_ui(SDL_Window *sdl_win, Configuration &conf, UI_State &ui, Frame_Inp
 			if (point > 0)
 				indicator_pos.x = in.mouse_state.pos.x - indicator_size.x;			
 
-			text({indicator_pos, indicator_size}, l.minor_padding, conf.seek_bar_text_col, text_font, indicator_text.str().c_str());
+			text({indicator_pos, indicator_size}, l.minor_padding, conf.seek_bar_text_col, text_font, indicator_text);
+			seek_bar_thumbnail(ui, info, l, in.mouse_state.pos.x, info.c_time + time);
 
-			if (in.left_click) {
-				if (!info.exploring)
-					p.explore();
-				p.set_explore_time(info.c_time + time);
-			}
+			if (in.left_click)
+				ui_command(ch, UI_EXPLORE, time);
 		}
 
 		if (info.exploring)
 		{
-			text(l.explore_status, l.major_padding, conf.ui_text_col, text_font, sec_to_timestr(info.e_time).c_str());
+			text(l.explore_status, l.major_padding, conf.ui_text_col, text_font, sec_to_timestr(timestr, info.e_time));
 
 			if (button(conf, ui, in, l.cancel_but, l.major_padding, text_font, "Cancel"))
-				p.explore_cancel();
+				ui_command(ch, UI_EXPLORE_CANCEL);
 
 			if (button(conf, ui, in, l.accept_but, l.major_padding, text_font, "Accept"))
-				p.explore_accept();
+				ui_command(ch, UI_EXPLORE_ACCEPT);
 		}
 	}
 
@@ -503,8 +1060,14 @@ void create_ui(SDL_Window *sdl_win, Configuration &conf, UI_State &ui, Frame_Inp
 
 	bool mouse_on_nothing = !(intersects_rect(in.mouse_state.pos, l.ui_bg) || intersects_rect(in.mouse_state.pos, l.chat_input));
 
-	bool left_clicked = ui.left_down_on_nothing.has_value() && !in.left_click && ui.left_down_on_nothing->pos == in.mouse_state.pos
-		&& ui.left_down_on_nothing->global_pos == in.mouse_state.global_pos;
+	hit_test_state.ui_bg = l.ui_bg;
+	hit_test_state.chat_input = l.chat_input;
+	hit_test_state.fullscreen = ui.fullscreen;
+
+	// Outside fullscreen, presses on nothing go to the window manager and
+	// only show up as hit tests.
+	bool left_clicked = in.drag_area_click || (ui.left_down_on_nothing.has_value() && !in.left_click
+		&& ui.left_down_on_nothing->pos == in.mouse_state.pos);
 
 	if (left_clicked) {
 		auto fullscreen_click = std::chrono::steady_clock::now();
@@ -517,11 +1080,6 @@ void create_ui(SDL_Window *sdl_win, Configuration &conf, UI_State &ui, Frame_Inp
 		}
 	}
 
-	if (ui.left_down_on_nothing.has_value() && ui.left_down_on_nothing->global_pos != in.mouse_state.global_pos) {
-		ImVec2 delta = in.mouse_state.global_pos - ui.left_down_on_nothing->global_pos;
-		move_window(sdl_win, delta.x, delta.y);
-	}
-
 	if (mouse_on_nothing && in.left_click && !ui.left_down_on_something)
 		ui.left_down_on_nothing = in.mouse_state;
 	else
@@ -542,20 +1100,61 @@ void create_ui(SDL_Window *sdl_win, Configuration &conf, UI_State &ui, Frame_Inp
 	if (in.left_up) ui.initial_left_down.reset();
 }
 
-Frame_Input get_sdl_input(SDL_Window *win)
+void toggle_trace_overlay(UI_State &ui)
 {
-	Frame_Input in;
+	ui.trace_overlay = !ui.trace_overlay;
+	if (ui.trace_overlay && !trace_on) {
+		trace_set_enabled(true);
+		ui.trace_overlay_owns_tracing = true;
+	} else if (!ui.trace_overlay && ui.trace_overlay_owns_tracing) {
+		trace_set_enabled(false);
+		ui.trace_overlay_owns_tracing = false;
+	}
+	ui.trace_stages.clear();
+	ui.trace_stages_time = {};
+}
+
+// Rolling per-stage timings of both threads, refreshed twice a second.
+void trace_overlay(UI_State &ui)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (now - ui.trace_stages_time >= std::chrono::milliseconds(500)) {
+		ui.trace_stages = trace_summary(5);
+		ui.trace_stages_time = now;
+	}
 
-	int mouse_x, mouse_y;
-	uint32_t button_state = SDL_GetMouseState(&mouse_x, &mouse_y);
-	in.mouse_state.pos = ImVec2(mouse_x, mouse_y);
-	in.left_click = button_state & SDL_BUTTON(SDL_BUTTON_LEFT);
-	SDL_GetGlobalMouseState(&mouse_x, &mouse_y);
-	in.mouse_state.global_pos = ImVec2(mouse_x, mouse_y);
-	in.mouse_state.in_window = SDL_GetMouseFocus() == win;
+	ImGui::SetNextWindowPos(ImVec2(10, 10));
+	ImGui::SetNextWindowBgAlpha(0.75f);
+	ImGui::Begin("Trace", nullptr,
+		ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_AlwaysAutoResize |
+			ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoInputs);
+	if (!trace_on)
+		ImGui::TextUnformatted("tracing is off");
+	ImGui::Text("%-28s %7s %8s %8s", "last 5 s", "count", "p50 ms", "p99 ms");
+	for (auto &s : ui.trace_stages)
+		ImGui::Text("%-28s %7zu %8.3f %8.3f", s.name, s.count, s.p50_ms, s.p99_ms);
+	ImGui::End();
+}
+
+// Blocks for up to timeout milliseconds (forever if negative) until an event
+// arrives, then drains the queue. redraw is set for anything other than a
+// wakeup from another thread.
+Frame_Input get_sdl_input(int timeout)
+{
+	// Followed through events rather than asked for every frame.
+	static Mouse_State mouse = {};
+	static bool left_down = false;
+
+	Frame_Input in;
 
 	SDL_Event e;
-	while (SDL_PollEvent(&e)) {
+	int have_event = timeout < 0 ? SDL_WaitEvent(&e) : SDL_WaitEventTimeout(&e, timeout);
+	for (; have_event; have_event = SDL_PollEvent(&e)) {
+		if (e.type == wake_event) {
+			wake_pending = false;
+			continue;
+		}
+		in.redraw = true;
 		switch (e.type) {
 		case SDL_QUIT:
 			exit(EXIT_SUCCESS);
@@ -565,6 +1164,9 @@ Frame_Input get_sdl_input(SDL_Window *win)
 			case SDLK_F11:
 				in.fullscreen = true;
 				break;
+			case SDLK_F3:
+				in.toggle_trace_overlay = true;
+				break;
 			case SDLK_RETURN:
 				in.ret = true;
 				ImGui_ImplSDL2_ProcessEvent(&e);
@@ -576,9 +1178,36 @@ Frame_Input get_sdl_input(SDL_Window *win)
 				ImGui_ImplSDL2_ProcessEvent(&e);
 			}
 			break;
-		case SDL_MOUSEBUTTONUP:
+		case SDL_MOUSEMOTION:
+			mouse.pos = ImVec2(e.motion.x, e.motion.y);
+			ImGui_ImplSDL2_ProcessEvent(&e);
+			break;
+		case SDL_MOUSEBUTTONDOWN:
+			mouse.pos = ImVec2(e.button.x, e.button.y);
 			if (e.button.button == SDL_BUTTON_LEFT)
+				left_down = true;
+			ImGui_ImplSDL2_ProcessEvent(&e);
+			break;
+		case SDL_MOUSEBUTTONUP:
+			mouse.pos = ImVec2(e.button.x, e.button.y);
+			if (e.button.button == SDL_BUTTON_LEFT) {
+				left_down = false;
 				in.left_up = true;
+			}
+			break;
+		case SDL_WINDOWEVENT:
+			if (e.window.event == SDL_WINDOWEVENT_ENTER)
+				mouse.in_window = true;
+			else if (e.window.event == SDL_WINDOWEVENT_LEAVE)
+				mouse.in_window = false;
+			else if (e.window.event == SDL_WINDOWEVENT_HIT_TEST)
+				in.drag_area_click = true;
+			else if (e.window.event == SDL_WINDOWEVENT_MINIMIZED || e.window.event == SDL_WINDOWEVENT_HIDDEN)
+				in.hidden = true;
+			else if (e.window.event == SDL_WINDOWEVENT_RESTORED || e.window.event == SDL_WINDOWEVENT_SHOWN
+				|| e.window.event == SDL_WINDOWEVENT_MAXIMIZED)
+				in.hidden = false;
+			ImGui_ImplSDL2_ProcessEvent(&e);
 			break;
 		case SDL_MOUSEWHEEL:
 			if (e.wheel.y < 0)
@@ -586,20 +1215,222 @@ Frame_Input get_sdl_input(SDL_Window *win)
 			else if (e.wheel.y > 0)
 				in.scroll_up = true;
 			break;
-		case SDL_WINDOWEVENT:
-			if (e.window.event == SDL_WINDOWEVENT_EXPOSED)
-				in.redraw = true;
-			break;
 		default:
 			ImGui_ImplSDL2_ProcessEvent(&e);
 		}
 	}
 
+	in.mouse_state = mouse;
+	in.left_click = left_down;
+
 	return in;
 }
 
+// Earliest time at which the UI will look different without any input:
+// the controls hiding, the time label ticking over, or chat messages
+// starting or continuing to fade.
+std::optional<time_point> next_redraw_time(UI_State &ui, Chat &c, const PlayerInfo &info, time_point now)
+{
+	std::optional<time_point> t;
+	auto consider = [&](time_point p) {
+		if (!t.has_value() || p < *t)
+			t = p;
+	};
+	using seconds = std::chrono::duration<double>;
+	auto after = [&](double s) {
+		return now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(seconds(s));
+	};
+
+	auto ui_timeout = ui.last_activity + std::chrono::seconds(2);
+	if (now < ui_timeout)
+		consider(ui_timeout);
+
+	if (ui.display_ui) {
+		bool playing = info.exploring ? !info.e_paused : !info.c_paused;
+		double shown = info.exploring ? info.e_time : info.c_time;
+		if (playing)
+			consider(after(1.0 - (shown - std::floor(shown))));
+	}
+
+	if (ui.trace_overlay)
+		consider(ui.trace_stages_time + std::chrono::milliseconds(500));
+
+	if (ui.fullscreen) {
+		if (ui.chat_layout_pending)
+			consider(now);
+		auto e = c.get_last_end_scroll_time();
+		for (size_t i = c.end(); i-- > 0;) {
+			Chat_Message *m = c.message(i);
+			if (m == nullptr)
+				break;
+			double age = seconds(now - std::max(m->time, e)).count();
+			if (age >= chat_fade_delay + chat_fade_duration)
+				break;
+			if (age >= chat_fade_delay)
+				consider(after(1.0 / 60));
+			else
+				consider(after(chat_fade_delay - age));
+		}
+	}
+
+	return t;
+}
+
+// Applies what the control thread sent for the render thread. Returns
+// whether there was anything.
+bool apply_render_updates(Control_Channels &ch, Chat &chat, Configuration &conf)
+{
+	TRACE_SCOPE("render_updates");
+	bool any = false;
+	while (Render_Update *u = ch.render.read_slot())
+	{
+		if (u->kind == Render_Update::CHAT_MESSAGE)
+			chat.add_message(u->message);
+		else
+			conf.*u->color = u->value;
+		ch.render.release();
+		any = true;
+	}
+	return any;
+}
+
+// Looks for one of the files installed along with moov.
+std::optional<std::filesystem::path> find_file(const char *name)
+{
+	auto exe_dir = getexepath().parent_path();
+	std::filesystem::path lookup_dirs[] = {
+		exe_dir,
+		exe_dir / ".." / "share" / "moov",
+		std::filesystem::current_path()
+	};
+	for (auto &dir : lookup_dirs)
+		if (std::filesystem::is_regular_file(dir / name))
+			return dir / name;
+	return std::nullopt;
+}
+
+// The command given with --resolver, which may be empty for none. Without
+// one the installed ytdl_resolver.py is used.
+std::optional<std::string> resolver_command;
+Resolver resolver;
+
+void start_resolver(Player &p)
+{
+	std::string command;
+	if (resolver_command.has_value()) {
+		command = *resolver_command;
+	} else if (auto script = find_file("ytdl_resolver.py")) {
+		std::string path = script->string();
+		command = "python3 '";
+		for (char c : path)
+			command += c == '\'' ? std::string("'\\''") : std::string(1, c);
+		command += "'";
+	}
+	if (command.empty())
+		return;
+	auto wake = [](void *player) { static_cast<Player *>(player)->wakeup(); };
+	if (resolver.start(command, wake, &p))
+		p.set_resolver(&resolver);
+	else
+		std::cerr << "could not start resolver: " << command << std::endl;
+}
+
+// Hands the player to the control thread and starts reading stdin.
+void start_control(Control_Channels &ch, Player &p)
+{
+	start_resolver(p);
+	ch.player = &p;
+	ch.info.back() = p.get_info();
+	ch.info.publish();
+
+	stats.mark_time = std::chrono::steady_clock::now();
+	stats.mark_cpu = std::clock();
+
+	auto input_thread = std::thread(read_input, std::ref(ch));
+	input_thread.detach();
+	auto control_thread = std::thread(control_loop, std::ref(ch));
+	control_thread.detach();
+}
+
+// The render thread of --headless. It keeps the chat and colours up to
+// date like the windowed loop, so the protocol behaves the same, and with
+// HEADLESS_SW renders every new frame into a buffer nobody looks at.
+// The control thread exits once stdin ends and its commands are handled.
+[[noreturn]] void headless_main()
+{
+	auto mpvh = Player();
+	mpvh.set_headless(headless == HEADLESS_SW);
+
+	constexpr int width = 1280, height = 720;
+	std::vector<uint8_t> pixels;
+	mpv_render_context *mpv_ctx = nullptr;
+	if (headless == HEADLESS_SW) {
+		mpv_render_param render_params[] = {
+			{ MPV_RENDER_PARAM_API_TYPE, const_cast<char *>(MPV_RENDER_API_TYPE_SW) },
+			{ MPV_RENDER_PARAM_INVALID, nullptr }
+		};
+		mpvh.create_render_context(&mpv_ctx, render_params);
+		if (mpv_ctx == nullptr)
+			die("mpv software render context failed");
+		mpv_render_context_set_update_callback(mpv_ctx, on_mpv_redraw, nullptr);
+		pixels.resize((size_t)width * height * 4);
+	}
+
+	Configuration conf;
+	Chat chat;
+	static Control_Channels channels;
+	start_control(channels, mpvh);
+
+	trace_thread_name("render");
+	while (1) {
+		wake_pending.wait(false);
+		// Cleared before looking, so a wakeup from here on is not lost.
+		wake_pending = false;
+		stats.wakeups++;
+
+		apply_render_updates(channels, chat, conf);
+		channels.info.update();
+
+		if (mpv_ctx == nullptr)
+			continue;
+		uint64_t flags;
+		{
+			TRACE_SCOPE("mpv_render_context_update");
+			flags = mpv_render_context_update(mpv_ctx);
+		}
+		if (flags & MPV_RENDER_UPDATE_FRAME) {
+			int size[2] = { width, height };
+			size_t stride = width * 4;
+			mpv_render_param params[] = {
+				{ MPV_RENDER_PARAM_SW_SIZE, size },
+				{ MPV_RENDER_PARAM_SW_FORMAT, const_cast<char *>("rgb0") },
+				{ MPV_RENDER_PARAM_SW_STRIDE, &stride },
+				{ MPV_RENDER_PARAM_SW_POINTER, pixels.data() },
+				{ MPV_RENDER_PARAM_INVALID, nullptr }
+			};
+			TRACE_SCOPE("mpv_render_context_render");
+			mpv_render_context_render(mpv_ctx, params);
+			stats.frames++;
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
+	for (int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+		if (arg == "--headless")
+			headless = HEADLESS_NULL;
+		else if (arg == "--headless=sw")
+			headless = HEADLESS_SW;
+		else if (arg == "--headless=null")
+			headless = HEADLESS_NULL;
+		else if (arg.substr(0, 11) == "--resolver=")
+			resolver_command = std::string(arg.substr(11));
+	}
+	if (headless != HEADLESS_OFF)
+		headless_main();
+
 	float font_size;
 
 	SDL_Window *window;
@@ -614,9 +1445,11 @@ int main(int argc, char **argv)
 		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
 		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
 		SDL_SetHint(SDL_HINT_MOUSE_FOCUS_CLICKTHROUGH, "1");
+		wake_event = SDL_RegisterEvents(1);
 		window = SDL_CreateWindow("Moov", SDL_WINDOWPOS_CENTERED,
 			SDL_WINDOWPOS_CENTERED, 1280, 720,
 			SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+		SDL_SetWindowHitTest(window, hit_test, &hit_test_state);
 		SDL_GL_CreateContext(window);
 		SDL_GLContext gl_context = SDL_GL_CreateContext(window);
 		glewInit();
@@ -624,6 +1457,9 @@ int main(int argc, char **argv)
 		SDL_GL_SetSwapInterval(1);
 
 		IMGUI_CHECKVERSION();
+#ifdef MOOV_COUNT_ALLOCS
+		ImGui::SetAllocatorFunctions(alloc_count_malloc, alloc_count_free);
+#endif
 		ImGui::CreateContext();
 		ImGui::StyleColorsClassic();
 		ImGui_ImplSDL2_InitForOpenGL(window, gl_context);
@@ -636,22 +1472,6 @@ int main(int argc, char **argv)
 
 		ImGuiIO &io = ImGui::GetIO();
 
-		auto exe_dir = getexepath().parent_path();
-		auto cwd = std::filesystem::current_path();
-
-		std::filesystem::path lookup_dirs[] = {
-			exe_dir,
-			exe_dir / ".." / "share" / "moov",
-			cwd
-		};
-
-		auto find_file = [&](const char *font) {
-			for (auto &dir : lookup_dirs)
-				if (std::filesystem::is_regular_file(dir / font))
-					return std::optional(dir / font);
-			return std::optional<std::filesystem::path>();
-		};
-
 		auto text_font_path = find_file("Roboto-Medium.ttf");
 		if (text_font_path.has_value())
 			text_font = io.Fonts->AddFontFromFileTTF(text_font_path->string().c_str(), font_size);
@@ -686,44 +1506,90 @@ int main(int argc, char **argv)
 	};
 	mpvh.create_render_context(&mpv_ctx, render_params);
 	mpv_render_context_set_update_callback(mpv_ctx, on_mpv_redraw, nullptr);
+	// Made once the control thread makes the preview instance, on the
+	// first explore.
+	mpv_render_context *preview_ctx = nullptr;
+	bool preview_ready = false;
+	Pip_Target pip;
 
 	Configuration conf;
 	Chat chat;
-	std::queue<json> input_queue;
-	std::mutex input_lock;
-
-	auto input_thread = std::thread(read_input, std::ref(input_lock), std::ref(input_queue));
-	input_thread.detach();
+	static Control_Channels channels;
+	start_control(channels, mpvh);
 
 	UI_State ui;
 	ui.last_activity = std::chrono::steady_clock::now();
 
+	// From here on this is the render thread. It sleeps until mpv has a new
+	// frame, SDL has input, the control thread has a change for the UI, or
+	// a UI timer runs out, and only renders when one of those changed what
+	// is on screen. Every input frame is followed by one more so ImGui can
+	// settle its state.
+	trace_thread_name("render");
+	int pending_frames = 1;
+	std::optional<time_point> redraw_time;
+	std::optional<std::string> shown_title;
+	Layout_Cache layout_cache;
+#ifdef MOOV_COUNT_ALLOCS
+	// Frames in a row without input or updates from the control thread.
+	// From the second one on, nothing new is shown but the video and the
+	// time, so nothing should need memory that the frame before did not.
+	// The first frames, while ImGui sets itself up, do not count.
+	int quiet_frames = -60;
+#endif
+
 	while (1) {
-		bool queue_empty = false;
-		while (!queue_empty)
-		{
-			json j;
-			{
-				std::lock_guard<std::mutex> guard(input_lock);
-				queue_empty = input_queue.empty();
-				if (!queue_empty)
-				{
-					j = input_queue.front();
-					input_queue.pop();
-				}
-			}
-			if (!queue_empty)
-			{
-				handle_instruction(mpvh, chat, conf, j);
-			}
-		}
+		int timeout = -1;
+		auto now = std::chrono::steady_clock::now();
+		if (pending_frames > 0)
+			timeout = 0;
+		else if (redraw_time.has_value())
+			timeout = std::max(0l, (long)std::chrono::duration_cast<std::chrono::milliseconds>(*redraw_time - now).count() + 1);
+
+		Frame_Input input = get_sdl_input(timeout);
+		stats.wakeups++;
+		if (input.redraw)
+			pending_frames = 2;
+#ifdef MOOV_COUNT_ALLOCS
+		if (input.redraw)
+			quiet_frames = 0;
+#endif
 
-		Frame_Input input = get_sdl_input(window);
-		mpvh.update();
+		if (apply_render_updates(channels, chat, conf)) {
+			pending_frames = 2;
+#ifdef MOOV_COUNT_ALLOCS
+			quiet_frames = 0;
+#endif
+		}
+		if (channels.info.update())
+			pending_frames = std::max(pending_frames, 1);
+		if (thumbnail_atlas.upload(thumbnailer))
+			pending_frames = std::max(pending_frames, 1);
 
-		auto info = mpvh.get_info();
-		std::string window_title = info.title == "" ? "Moov" : info.title + " - Moov";
-		SDL_SetWindowTitle(window, window_title.c_str());
+		{
+			TRACE_SCOPE("mpv_render_context_update");
+			if (mpv_render_context_update(mpv_ctx) & MPV_RENDER_UPDATE_FRAME)
+				pending_frames = std::max(pending_frames, 1);
+			if (preview_ctx != nullptr && mpv_render_context_update(preview_ctx) & MPV_RENDER_UPDATE_FRAME)
+				pending_frames = std::max(pending_frames, 1);
+		}
+		now = std::chrono::steady_clock::now();
+		if (redraw_time.has_value() && now >= *redraw_time)
+			pending_frames = std::max(pending_frames, 1);
+
+		auto &info = channels.info.front();
+		if (info.preview != nullptr && preview_ctx == nullptr) {
+			mpv_render_context_create(&preview_ctx, info.preview, render_params);
+			mpv_render_context_set_update_callback(preview_ctx, on_mpv_redraw, nullptr);
+		}
+		// Retried next time if the command doesn't fit.
+		if (preview_ctx != nullptr && !preview_ready)
+			preview_ready = ui_command(channels, UI_PREVIEW_READY);
+		if (shown_title != info.title) {
+			shown_title = info.title;
+			std::string window_title = info.title == "" ? "Moov" : info.title + " - Moov";
+			SDL_SetWindowTitle(window, window_title.c_str());
+		}
 
 		if ((info.c_paused && !info.exploring) || (info.e_paused && info.exploring))
 			SDL_EnableScreenSaver();
@@ -734,45 +1600,76 @@ int main(int argc, char **argv)
 			toggle_fullscreen(window, ui);
 		if (ui.fullscreen && input.exit_fullscreen)
 			toggle_fullscreen(window, ui);
+		if (input.toggle_trace_overlay) {
+			toggle_trace_overlay(ui);
+			pending_frames = std::max(pending_frames, 1);
+		}
+		// SDL has no event for a window covered by others, so this only
+		// catches minimizing and hiding.
+		if (input.hidden.has_value() && *input.hidden != ui.window_hidden) {
+			ui.window_hidden = *input.hidden;
+			ui_command(channels, ui.window_hidden ? UI_WINDOW_HIDDEN : UI_WINDOW_SHOWN);
+		}
+		if (ui.window_hidden) {
+			pending_frames = 0;
+			redraw_time.reset();
+			continue;
+		}
+
+		if (pending_frames == 0) {
+			redraw_time = next_redraw_time(ui, chat, info, now);
+			continue;
+		}
+		pending_frames--;
+		stats.frames++;
+		TRACE_SCOPE("frame");
+#ifdef MOOV_COUNT_ALLOCS
+		uint64_t allocs_before = thread_allocations();
+#endif
 
 		int w, h;
 		SDL_GetWindowSize(window, &w, &h);
 		glClear(GL_COLOR_BUFFER_BIT);
 
-		mpv_opengl_fbo mpfbo{
-			static_cast<int>(MPV_RENDER_PARAM_OPENGL_FBO),
-			w, h, 0
-		};
-		int flip_y = 1;
-
-		int block = 0;
-
-		mpv_render_param params[] = {
-			{ MPV_RENDER_PARAM_OPENGL_FBO, &mpfbo },
-			{ MPV_RENDER_PARAM_FLIP_Y, &flip_y },
-#ifndef __linux__
-			{ MPV_RENDER_PARAM_BLOCK_FOR_TARGET_TIME, &block },
-#endif
-			{ MPV_RENDER_PARAM_INVALID, nullptr }
-		};
-		mpv_render_context_render(mpv_ctx, params);
+		// Exploring swaps the preview in and shows the canonical playback,
+		// which goes on, in a corner.
+		if (info.exploring && preview_ctx != nullptr) {
+			render_video(preview_ctx, 0, w, h);
+			render_pip(pip, mpv_ctx, w, h);
+		} else {
+			render_video(mpv_ctx, 0, w, h);
+		}
 
 		ImGui_ImplOpenGL3_NewFrame();
 		ImGui_ImplSDL2_NewFrame(window);
 		ImGui::NewFrame();
 
-		Layout l = calculate_layout(font_size, w, h, text_font, icon_font);
+		const Layout &l = cached_layout(layout_cache, font_size, w, h, text_font, icon_font);
 
-		create_ui(window, conf, ui, input, mpvh, l, chat);
+		{
+			TRACE_SCOPE("create_ui");
+			create_ui(window, conf, ui, input, info, channels, l, chat);
+		}
+		if (ui.trace_overlay)
+			trace_overlay(ui);
 		glViewport(0, 0, w, h);
-		ImGui::Render();
-		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-		SDL_GL_SwapWindow(window);
-
-#ifdef __linux__
-		if ((info.c_paused && !info.exploring) || (info.e_paused && info.exploring))
-			SDL_Delay(14);
+		{
+			TRACE_SCOPE("imgui_render");
+			ImGui::Render();
+			ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+		}
+		{
+			TRACE_SCOPE("swap");
+			SDL_GL_SwapWindow(window);
+		}
+#ifdef MOOV_COUNT_ALLOCS
+		uint64_t frame_allocs = thread_allocations() - allocs_before;
+		if (quiet_frames >= 2 && !ui.trace_overlay && frame_allocs != 0)
+			die("steady-state frame made " + std::to_string(frame_allocs) + " heap allocations");
+		quiet_frames++;
 #endif
+
+		redraw_time = next_redraw_time(ui, chat, info, std::chrono::steady_clock::now());
 	}
 
 	return 0;
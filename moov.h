@@ -1,14 +1,24 @@
 #pragma once
 
+#include <cstdio>
 #include <string>
+#include <atomic>
 #include <vector>
 #include <chrono>
+#include <ctime>
 #include <optional>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string_view>
 #include <filesystem>
 #include <mpv/client.h>
 #include <mpv/render.h>
 #include <mpv/render_gl.h>
 #include "imgui/imgui.h"
+#include "clock.h"
+#include "sync.h"
+#include "trace.h"
 
 using time_point = std::chrono::time_point<std::chrono::steady_clock>;
 
@@ -25,32 +35,127 @@ enum Command {
 	IN_CLOSE = 9,
 };
 
+// How chatbox draws a message, kept between frames. The size depends on
+// the wrap width and the font, and the vertices, which are relative to the
+// message's top left corner and at full opacity, on the padding as well.
+struct Message_Geometry {
+	float wrap_width = -1;
+	float padding = -1;
+	ImFont *font = nullptr;
+	ImVec2 text_size;
+	bool built = false;
+	// The background's vertices come first, then the text's.
+	std::vector<ImDrawVert> vtx;
+	std::vector<ImDrawIdx> idx;
+	size_t bg_vtx_count = 0;
+};
+
 struct Message {
 	std::string text;
 	time_point time;
 	unsigned fg, bg;
 };
 
+// A message as the chat keeps it, with its text in the chat's arena.
+struct Chat_Message {
+	std::string_view text;
+	time_point time;
+	unsigned fg, bg;
+	Message_Geometry geometry;
+};
+
+// The chat log. Every message is appended to a temporary file as it
+// arrives, and only a window of consecutive messages is kept in memory: a
+// ring of at most max_messages whose text lives in a fixed arena. The
+// window follows the newest messages, except while scrolled back, when the
+// messages around the cursor are read back from the file. Memory use
+// therefore does not grow with the length of the session.
 struct Chat {
+	static constexpr size_t max_messages = 256;
+	static constexpr size_t arena_size = 1 << 18;
+	// Longer messages are cut off.
+	static constexpr size_t max_message_size = arena_size / 8;
+	// How many messages before the cursor are kept in memory while
+	// scrolled back; more than can ever be on screen.
+	static constexpr size_t page_size = 64;
+
+	Chat();
+	~Chat();
+	Chat(const Chat &) = delete;
+	Chat &operator=(const Chat &) = delete;
 
 	void add_message(const Message &m);
-	std::pair<Message *, size_t> messages();
+	// One past the newest message to show. Messages are numbered from the
+	// start of the session.
+	size_t end() const { return cursor; }
+	// The message numbered i, or nullptr if it is not in memory.
+	Chat_Message *message(size_t i);
 	void scroll_up();
 	void scroll_down();
 	time_point get_last_end_scroll_time();
 
 private:
-	std::vector<Message> log;
+	struct Record {
+		uint64_t text_offset;
+		uint32_t text_size;
+		uint32_t fg, bg;
+		int64_t time;
+	};
+
+	void push(const Record &r, const char *text);
+	void pop_oldest();
+	char *arena_alloc(size_t size);
+	void load_around(size_t at);
+
+	std::vector<Chat_Message> ring;
+	std::vector<char> arena;
+	size_t arena_head = 0;
+	// Number of the oldest message in memory, the ring slot it is in, and
+	// how many there are.
+	size_t first = 0, first_slot = 0, count = 0;
+	size_t total = 0;
 	size_t cursor = 0;
 	time_point last_end_scroll_time;
+
+	// Fixed-size Records, and the texts they point to.
+	FILE *index_file = nullptr;
+	FILE *text_file = nullptr;
+	uint64_t text_file_size = 0;
+};
+
+enum Track_Type {
+	TRACK_VIDEO,
+	TRACK_AUDIO,
+	TRACK_SUB,
+	TRACK_OTHER
+};
+
+// An entry of mpv's track-list. Ids count from 1 per type.
+struct Track {
+	Track_Type type;
+	int64_t id;
+	std::string lang, title, codec;
+	bool is_default;
 };
 
+using Track_Table = std::vector<Track>;
+
+struct Stream_Headers;
+
 struct PlayerInfo {
 	int64_t pl_pos, pl_count;
 	int muted;
 
 	std::string title;
+	// What mpv opened for the current entry: a resolved stream URL rather
+	// than the page, if the resolver had one. Other instances opening it
+	// need the same headers, which are shared like tracks.
+	std::string media_path;
+	std::shared_ptr<const Stream_Headers> media_headers;
 	double duration;
+	// Replaced as a whole when mpv's track-list changes, and shared so that
+	// copies of the info do not copy it.
+	std::shared_ptr<const Track_Table> tracks;
 	int64_t audio_pos, audio_count;
 	int64_t sub_pos, sub_count;
 
@@ -60,17 +165,124 @@ struct PlayerInfo {
 	int exploring;
 	double e_time;
 	int e_paused;
+	// The explore mode instance once there is one, for the render thread
+	// to make a render context for.
+	mpv_handle *preview;
 };
 
+// The id of the track of a type after current, back to the first after the
+// last one, or 0 if there are none. Goes by info.tracks alone, without
+// asking mpv.
+int64_t next_track_id(const PlayerInfo &info, Track_Type type, int64_t current);
+
+struct Stats {
+	// Counters over the interval since the last request_stats.
+	// wakeups and frames are counted on the render thread, the rest on the
+	// control thread, which also reports and resets them.
+	std::atomic<uint64_t> wakeups = 0;
+	std::atomic<uint64_t> frames = 0;
+	size_t ipc_queue_peak = 0;
+	uint64_t render_updates_dropped = 0;
+	// Time the window was hidden, and the CPU time that saved going by
+	// the rate while shown, which is kept over the whole run.
+	double hidden_time = 0, hidden_cpu_saved = 0;
+	double shown_time = 0, shown_cpu = 0;
+	// Chat messages that Chat_Ingest collapsed unseen, and
+	// layouts of chat messages that chatbox put off to a later frame. The
+	// latter is counted on the render thread.
+	uint64_t chat_collapsed = 0;
+	std::atomic<uint64_t> chat_layouts_deferred = 0;
+	// libmpv client API calls made by Player, in total and the most in one
+	// loop iteration.
+	uint64_t mpv_calls = 0;
+	uint64_t mpv_calls_peak = 0;
+	uint64_t mpv_write_errors = 0;
+	// Playlist switches that got to their first frame, and how long that
+	// took in seconds.
+	uint64_t switches = 0;
+	double switch_time_total = 0, switch_time_max = 0;
+	// Times prefetching of the next entry was turned on.
+	uint64_t prefetches = 0;
+	time_point mark_time;
+	std::clock_t mark_cpu;
+};
+
+extern Stats stats;
+
+// Limits how fast chat messages are passed on to the render thread, on the
+// control thread. Up to burst messages go through at once and rate per
+// second after that. Up to max_held messages arriving faster are held back
+// in order and released at that rate. Those past that collapse into one
+// entry showing the newest of them and how many it stands for, so a flood
+// delays what is typed during it by max_held / rate seconds at most.
+struct Chat_Ingest {
+	double rate = 10;
+	double burst = 20;
+	size_t max_held = 20;
+
+	// Returns whether a message arriving now can go through. If not, it
+	// must be passed to hold().
+	bool admit(time_point now);
+	void hold(std::string_view text, std::string_view fg, std::string_view bg);
+	// Fills out with the oldest held message once one can go through.
+	bool take_held(time_point now, Message &out);
+	// When take_held should be tried again, if anything is held.
+	std::optional<time_point> next_release() const;
+
+private:
+	void refill(time_point now);
+
+	// Colors are decoded only for what is shown.
+	struct Held {
+		std::string text, fg, bg;
+		uint64_t folded = 0;
+	};
+
+	double tokens = 20;
+	time_point last_refill;
+	std::deque<Held> held;
+};
+
+// Pushes status_update messages to a client that subscribed with
+// subscribe_status. Only fields that changed are sent. The time is sent
+// when it stops matching what the client extrapolates from the last update
+// (time + elapsed while playing), i.e. on seeks, stalls and pauses.
+// Updates are spaced at least 1/max_rate apart, and with a heartbeat a
+// full update goes out whenever nothing was sent for that long.
+struct Status_Subscription {
+	void subscribe(double max_rate, double heartbeat);
+	void unsubscribe();
+	void update(const PlayerInfo &info, time_point now);
+	std::optional<time_point> next_update(time_point now) const;
+
+private:
+	bool active = false;
+	bool full = true;
+	double min_interval = 0;
+	double heartbeat = 0;
+	time_point last_sent, time_sent_at;
+	int64_t pl_pos = 0, pl_count = 0;
+	int paused = 0;
+	double time = 0, delay = 0;
+};
+
+class Resolver;
+struct Resolved;
+
 class Player {
 public:
 	Player();
+	void set_wakeup_callback(void (*cb)(void *), void *ctx);
 	void set_ytdl_format(const char *format);
+	// For running without a window: no audio output, no hardware decoding,
+	// and video either dropped or handed to a software render context.
+	void set_headless(bool software_render);
 	void add_file(const char *file);
+	void add_files(const std::vector<std::string_view> &files, std::string_view playlist, int64_t request_id);
 	void playlist_clear();
 	void pause(int paused);
 	void toggle_explore_paused();
-	PlayerInfo get_info();
+	const PlayerInfo &get_info();
 	void set_canonical(int64_t pl_pos, bool paused, double time);
 	void set_time(double time);
 	void set_pl_pos(int64_t pl_pos);
@@ -79,25 +291,163 @@ public:
 	void explore_cancel();
 	void explore_accept();
 	void explore();
+	void wait(double timeout);
+	// Interrupts wait(); may be called from any thread.
+	void wakeup();
 	void update();
 	void create_render_context(mpv_render_context **ctx, mpv_render_param render_params[]);
+	// The render thread has a render context for info.preview.
+	void preview_ready();
 	void set_audio(int64_t track);
 	void set_sub(int64_t track);
 	void force_sync();
+	// Turns video decoding off and on, for while nothing can see it. When
+	// it comes back the player seeks to the canonical time so the picture
+	// starts out in sync.
+	void set_video(bool enabled);
+	// Sends the property writes queued since the last call.
+	void flush_writes();
+	// Selects the drift controller by name; false if there is none.
+	bool set_sync_controller(std::string_view name);
+	// Has web URLs resolved by r before mpv opens them, instead of by
+	// mpv's ytdl hook.
+	void set_resolver(Resolver *r);
+	// Answers with a resolved message once url is resolved.
+	void resolve(std::string_view url, int64_t request_id);
+	// When a pause will have gone on long enough to prefetch the next
+	// entry, if that is still to come. Nothing else wakes the control
+	// thread while paused.
+	std::optional<time_point> prefetch_deadline();
+	// When a request to the resolver times out. A file held for one sends
+	// no events until then.
+	std::optional<time_point> resolve_deadline();
 
 private:
 	void syncmpv(bool force = false);
+	void seek_canonical(double time);
+	// Whether mpv may open the next playlist entry ahead of time.
+	bool prefetch_wanted();
+
+	// Properties are not set directly but queued and sent together with
+	// mpv_set_property_async by flush_writes, in this order. A value equal to
+	// the last one sent is not sent again unless forced; the last sent value
+	// is forgotten when mpv reports a different one or fails to set it.
+	enum Write_Id {
+		W_PLAYLIST_POS,
+		W_PAUSE,
+		W_VIDEO,
+		W_TIME_POS,
+		W_SPEED,
+		W_MUTE,
+		W_AUDIO,
+		W_SUB,
+		W_PREFETCH,
+		W_COUNT
+	};
+	union Write_Value {
+		int flag;
+		int64_t i;
+		double d;
+		// Only string literals.
+		const char *s;
+	};
+	struct Property_Write {
+		Write_Value value, sent;
+		bool queued, have_sent, force;
+	};
+	void write_property(Write_Id id, Write_Value v, bool force = false);
+	void write_flag(Write_Id id, int v) { Write_Value w; w.flag = v; write_property(id, w); }
+	void write_int64(Write_Id id, int64_t v) { Write_Value w; w.i = v; write_property(id, w); }
+	void write_double(Write_Id id, double v, bool force = false) { Write_Value w; w.d = v; write_property(id, w, force); }
+	void write_string(Write_Id id, const char *v) { Write_Value w; w.s = v; write_property(id, w); }
+	void observed_write(Write_Id id, Write_Value v);
+	static bool same_value(mpv_format format, Write_Value a, Write_Value b);
+	void handle_set_reply(mpv_event *e);
+	Property_Write writes[W_COUNT];
+	void observe_properties();
+	void handle_property_change(uint64_t id, mpv_event_property *prop);
+	void refresh_info();
+	void handle_event(mpv_event *e);
+	mpv_event *next_event(mpv_handle *handle, double timeout);
+	void handle_preview_event(mpv_event *e);
+	void create_preview();
+	void show_preview();
+	void load_preview();
+	void end_explore();
+
+	// Outstanding add_files batch, keyed by the reply userdata of its
+	// async loadfile/loadlist commands. pending and failed count commands;
+	// what was added is the change in playlist-count once all are done.
+	struct Add_Batch {
+		int64_t request_id;
+		int64_t pending, failed, count_before;
+		time_point start;
+	};
+	void handle_command_reply(mpv_event *e);
+	void finish_add_batch(const Add_Batch &batch);
+
+	std::map<uint64_t, Add_Batch> add_batches;
+	uint64_t next_batch_id;
+
+	// on_load hooks held until the resolver has an answer for the file, and
+	// resolve requests from the client waiting for one.
+	struct Load_Hook {
+		uint64_t id;
+		std::string url, format;
+	};
+	struct Resolve_Request {
+		int64_t request_id;
+		std::string url, format;
+	};
+	void handle_load_hook(uint64_t id);
+	void apply_resolved(const Resolved &r);
+	void handle_resolved();
+	void prefetch_resolve();
+	Resolver *resolver = nullptr;
+	std::string ytdl_format;
+	std::vector<Load_Hook> load_hooks;
+	std::vector<Resolve_Request> resolve_requests;
+	int64_t resolve_prefetched = -1;
 
 	mpv_handle *mpv;
-	int64_t last_time;
 	int64_t c_pos;
-	double c_time;
-	int c_paused;
+	Canonical_Clock clock;
 	int exploring;
 	double speed;
 
-	int64_t audio_count, sub_count;
-	std::string title;
+	// Explore mode plays on an instance of its own, so the canonical
+	// playback goes on, buffered and in sync: cancelling just shows it
+	// again and accepting is one seek. It is made on the first explore,
+	// never in headless mode. The current file is loaded into it once it
+	// can render and kept for the next explore, with a small cache.
+	mpv_handle *preview;
+	bool preview_enabled, preview_rendering;
+	std::string preview_path;
+	bool preview_loaded;
+	double preview_start;
+	double e_time;
+	int e_paused;
+
+	std::unique_ptr<Drift_Controller> drift;
+	int64_t last_update_us;
+	// Set from issuing a seek until playback restarts, which is how long
+	// the seek cost.
+	bool seeking;
+	int64_t seek_start_us;
+	// The last time the canonical clock was running.
+	int64_t playing_us;
+	bool prefetching;
+	// From switching to another playlist entry, or mpv moving on by itself,
+	// until the first frame of the new one; -1 if not switching. The
+	// playback restart that ends it must come after the new file started.
+	int64_t switch_start_us;
+	bool switch_started;
+
+	// Mirror of the observed mpv properties, kept up to date from
+	// MPV_EVENT_PROPERTY_CHANGE and written through when we set them.
+	int mpv_paused;
+	double mpv_time;
+	PlayerInfo info;
 };
 
 struct ImRect {
@@ -105,8 +455,8 @@ struct ImRect {
 };
 
 struct Mouse_State {
-	ImVec2 pos, global_pos;
-	bool in_window;
+	ImVec2 pos;
+	bool in_window = false;
 };
 
 struct Frame_Input {
@@ -119,6 +469,11 @@ struct Frame_Input {
 	bool fullscreen = false;
 	bool exit_fullscreen = false;
 	bool left_up = false;
+	bool toggle_trace_overlay = false;
+	// A press the hit test handed to the window manager for dragging.
+	bool drag_area_click = false;
+	// Set when the window was minimized, hidden or shown again.
+	std::optional<bool> hidden;
 };
 
 struct UI_State {
@@ -130,8 +485,23 @@ struct UI_State {
 	time_point last_activity;
 	ImVec2 last_mouse_pos;
 	bool delay_indicator_sign = false;
+	bool display_ui = false;
 	double seek_bar_scale = 40 * 60;
 	std::optional<Mouse_State> initial_left_down;
+	// Minimized or hidden; nothing is rendered meanwhile.
+	bool window_hidden = false;
+	// chatbox ran out of its layout budget and needs another frame.
+	bool chat_layout_pending = false;
+	// Playback position the last strip of seek bar thumbnails was asked
+	// for around.
+	double thumbnail_strip_time = -1;
+
+	// Stage timing overlay, toggled with F3. It turns tracing on while it
+	// is shown unless something else had already.
+	bool trace_overlay = false;
+	bool trace_overlay_owns_tracing = false;
+	std::vector<Trace_Stage> trace_stages;
+	time_point trace_stages_time;
 };
 
 
@@ -151,8 +521,15 @@ struct Configuration {
 	uint32_t seek_bar_text_col = decode_color("#FFFFFF");
 };
 
+// Room for the longest HH:MM:SS a uint32_t can give, a sign and the
+// terminator.
+constexpr size_t TIMESTR_SIZE = 16;
+// Writes HH:MM:SS into buf and returns it.
+char *sec_to_timestr(char *buf, uint32_t seconds);
 std::string sec_to_timestr(uint32_t seconds);
 void die(std::string_view str);
 void send_control(int64_t pos, double time, bool paused);
+void send_add_files_done(int64_t request_id, int64_t added, int64_t failed, double elapsed);
+void send_resolved(int64_t request_id, const Resolved &r);
 std::string statestr(double time, int paused, int64_t pl_pos, int64_t pl_count);
 std::filesystem::path getexepath();
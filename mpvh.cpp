@@ -5,204 +5,813 @@
 #include <assert.h>
 
 #include "moov.h"
+#include "resolver.h"
+#include "trace.h"
 
-void mpv_get_track_counts(mpv_handle *m, int64_t *audio, int64_t *sub)
-{
-	*audio = *sub = 0;
-	int64_t count;
-	mpv_get_property(m, "track-list/count", MPV_FORMAT_INT64, &count);
-	for (int i = 0; i < count; i++) {
-		char buf[100];
-		snprintf(buf, 99, "track-list/%d/type", i);
-		char *type;
-		mpv_get_property(m, buf, MPV_FORMAT_STRING, &type);
-		if (strcmp(type, "audio") == 0)
-			(*audio)++;
-		if (strcmp(type, "sub") == 0)
-			(*sub)++;
-		mpv_free(type);
+// A libmpv call, counted in stats.mpv_calls and traced under the name of
+// the function, so that neither is forgotten at a call site.
+#define MPV_CALL(fn, ...) ([&] { \
+	stats.mpv_calls++; \
+	TRACE_SCOPE(#fn); \
+	return fn(__VA_ARGS__); \
+}())
+
+enum Observed_Property : uint64_t {
+	OBS_PLAYLIST_POS = 1,
+	OBS_PLAYLIST_COUNT,
+	OBS_MUTE,
+	OBS_DURATION,
+	OBS_AUDIO,
+	OBS_SUB,
+	OBS_TIME_POS,
+	OBS_PAUSE,
+	OBS_MEDIA_TITLE,
+	OBS_TRACK_LIST,
+};
+
+// Reply userdata of async requests. Property writes use REPLY_SET_PROPERTY
+// plus their Write_Id; add_files batches count up from REPLY_ADD_FILES.
+enum Reply_Id : uint64_t {
+	REPLY_SET_PROPERTY = 1 << 8,
+	REPLY_ADD_FILES = 1 << 16,
+};
+
+// Name and format of each Player::Write_Id.
+static const struct {
+	const char *name;
+	mpv_format format;
+} write_props[] = {
+	{ "playlist-pos", MPV_FORMAT_INT64 },
+	{ "pause", MPV_FORMAT_FLAG },
+	{ "vid", MPV_FORMAT_STRING },
+	{ "time-pos", MPV_FORMAT_DOUBLE },
+	{ "speed", MPV_FORMAT_DOUBLE },
+	{ "ao-mute", MPV_FORMAT_FLAG },
+	{ "audio", MPV_FORMAT_INT64 },
+	{ "sub", MPV_FORMAT_INT64 },
+	{ "prefetch-playlist", MPV_FORMAT_FLAG },
+};
+
+// Seconds before the end of an entry, and of being paused, from which on
+// the next entry is likely to be wanted soon.
+constexpr double prefetch_lead = 60;
+constexpr double prefetch_pause = 10;
+
+// Options of the explore mode instance. It is silent and only ever seeks
+// around one file, so its cache is kept to a fraction of mpv's default.
+static const char *preview_options[][2] = {
+	{ "vo", "libmpv" },
+	{ "ao", "null" },
+	{ "aid", "no" },
+	{ "hwdec", "auto-copy" },
+	{ "hr-seek-framedrop", "no" },
+	{ "idle", "yes" },
+	{ "keep-open", "always" },
+	{ "pause", "yes" },
+	{ "demuxer-max-bytes", "32MiB" },
+	{ "demuxer-max-back-bytes", "16MiB" },
+};
+
+// Decodes the track-list property. Fields that are missing or of another
+// format are left empty.
+static Track_Table decode_track_list(const mpv_node *list)
+{
+	Track_Table tracks;
+	if (list->format != MPV_FORMAT_NODE_ARRAY)
+		return tracks;
+	tracks.reserve(list->u.list->num);
+	for (int i = 0; i < list->u.list->num; i++) {
+		const mpv_node &entry = list->u.list->values[i];
+		if (entry.format != MPV_FORMAT_NODE_MAP)
+			continue;
+		Track t = {};
+		t.type = TRACK_OTHER;
+		const mpv_node_list *fields = entry.u.list;
+		for (int j = 0; j < fields->num; j++) {
+			const char *key = fields->keys[j];
+			const mpv_node &v = fields->values[j];
+			if (v.format == MPV_FORMAT_STRING) {
+				const char *str = v.u.string;
+				if (strcmp(key, "type") == 0)
+					t.type = strcmp(str, "video") == 0 ? TRACK_VIDEO
+						: strcmp(str, "audio") == 0 ? TRACK_AUDIO
+						: strcmp(str, "sub") == 0 ? TRACK_SUB
+						: TRACK_OTHER;
+				else if (strcmp(key, "lang") == 0)
+					t.lang = str;
+				else if (strcmp(key, "title") == 0)
+					t.title = str;
+				else if (strcmp(key, "codec") == 0)
+					t.codec = str;
+			} else if (v.format == MPV_FORMAT_INT64 && strcmp(key, "id") == 0) {
+				t.id = v.u.int64;
+			} else if (v.format == MPV_FORMAT_FLAG && strcmp(key, "default") == 0) {
+				t.is_default = v.u.flag;
+			}
+		}
+		tracks.push_back(std::move(t));
+	}
+	return tracks;
+}
+
+int64_t next_track_id(const PlayerInfo &info, Track_Type type, int64_t current)
+{
+	int64_t next = 0, first = 0;
+	if (info.tracks == nullptr)
+		return 0;
+	for (auto &t : *info.tracks) {
+		if (t.type != type)
+			continue;
+		if (first == 0 || t.id < first)
+			first = t.id;
+		if (t.id > current && (next == 0 || t.id < next))
+			next = t.id;
 	}
+	return next != 0 ? next : first;
+}
+
+// A string property, or "" if it is unavailable.
+static std::string get_string(mpv_handle *handle, const char *name)
+{
+	char *value = MPV_CALL(mpv_get_property_string, handle, name);
+	std::string s = value != nullptr ? value : "";
+	mpv_free(value);
+	return s;
+}
+
+// Sets a string list option from its items, which may have commas in
+// them.
+static void set_string_list(mpv_handle *handle, const char *name, const std::vector<std::string> &items)
+{
+	std::vector<mpv_node> values(items.size());
+	for (size_t i = 0; i < items.size(); i++) {
+		values[i].format = MPV_FORMAT_STRING;
+		values[i].u.string = const_cast<char *>(items[i].c_str());
+	}
+	mpv_node_list list = { (int)values.size(), values.data(), nullptr };
+	mpv_node node;
+	node.format = MPV_FORMAT_NODE_ARRAY;
+	node.u.list = &list;
+	MPV_CALL(mpv_set_property, handle, name, MPV_FORMAT_NODE, &node);
+}
+
+static std::vector<std::string> get_string_list(mpv_handle *handle, const char *name)
+{
+	std::vector<std::string> items;
+	mpv_node node;
+	if (MPV_CALL(mpv_get_property, handle, name, MPV_FORMAT_NODE, &node) < 0)
+		return items;
+	if (node.format == MPV_FORMAT_NODE_ARRAY)
+		for (int i = 0; i < node.u.list->num; i++)
+			if (node.u.list->values[i].format == MPV_FORMAT_STRING)
+				items.push_back(node.u.list->values[i].u.string);
+	mpv_free_node_contents(&node);
+	return items;
 }
 
 Player::Player()
 {
-	mpv = mpv_create();
-	mpv_initialize(mpv);
-	mpv_set_option_string(mpv, "ytdl", "yes");
+	mpv = MPV_CALL(mpv_create);
+	MPV_CALL(mpv_initialize, mpv);
+	MPV_CALL(mpv_set_option_string, mpv, "ytdl", "yes");
 
-	mpv_set_option_string(mpv, "input-ipc-server", "/tmp/mpvsocket");
-	mpv_set_option_string(mpv, "hwdec", "auto-copy");
-	mpv_set_option_string(mpv, "hwdec-codecs", "all");
-	mpv_set_option_string(mpv, "hr-seek-framedrop", "no");
+	MPV_CALL(mpv_set_option_string, mpv, "input-ipc-server", "/tmp/mpvsocket");
+	MPV_CALL(mpv_set_option_string, mpv, "hwdec", "auto-copy");
+	MPV_CALL(mpv_set_option_string, mpv, "hwdec-codecs", "all");
+	MPV_CALL(mpv_set_option_string, mpv, "hr-seek-framedrop", "no");
 
+	preview = nullptr;
+	preview_enabled = true;
+	preview_rendering = false;
+	preview_loaded = false;
+	preview_start = 0;
+	e_time = 0;
+	e_paused = true;
 
-	last_time = mpv_get_time_us(mpv);
 	c_pos = 0;
-	c_time = 0;
-	c_paused = true;
+	clock.set(Canonical_Clock::now_us(), 0, true);
 	exploring = false;
 	speed = 1.0;
+	drift = make_drift_controller("default");
+	last_update_us = Canonical_Clock::now_us();
+	seeking = false;
+	seek_start_us = 0;
+	playing_us = last_update_us;
+	prefetching = false;
+	switch_start_us = -1;
+	switch_started = false;
+
+	next_batch_id = REPLY_ADD_FILES;
+	for (auto &w : writes)
+		w = {};
+
+	mpv_paused = false;
+	mpv_time = 0;
+	info = {};
+	info.pl_pos = -1;
+	info.title = "";
+	observe_properties();
+	refresh_info();
 
 	//syncmpv();
 }
 
+void Player::observe_properties()
+{
+	MPV_CALL(mpv_observe_property, mpv, OBS_PLAYLIST_POS, "playlist-pos", MPV_FORMAT_INT64);
+	MPV_CALL(mpv_observe_property, mpv, OBS_PLAYLIST_COUNT, "playlist-count", MPV_FORMAT_INT64);
+	MPV_CALL(mpv_observe_property, mpv, OBS_MUTE, "ao-mute", MPV_FORMAT_FLAG);
+	MPV_CALL(mpv_observe_property, mpv, OBS_DURATION, "duration", MPV_FORMAT_DOUBLE);
+	MPV_CALL(mpv_observe_property, mpv, OBS_AUDIO, "audio", MPV_FORMAT_INT64);
+	MPV_CALL(mpv_observe_property, mpv, OBS_SUB, "sub", MPV_FORMAT_INT64);
+	MPV_CALL(mpv_observe_property, mpv, OBS_TIME_POS, "time-pos", MPV_FORMAT_DOUBLE);
+	MPV_CALL(mpv_observe_property, mpv, OBS_PAUSE, "pause", MPV_FORMAT_FLAG);
+	MPV_CALL(mpv_observe_property, mpv, OBS_MEDIA_TITLE, "media-title", MPV_FORMAT_STRING);
+	// Comes with the whole list in one node whenever it changes, so
+	// loading a file with many tracks costs no further calls.
+	MPV_CALL(mpv_observe_property, mpv, OBS_TRACK_LIST, "track-list", MPV_FORMAT_NODE);
+}
+
+void Player::handle_property_change(uint64_t id, mpv_event_property *prop)
+{
+	// An unavailable property (no file loaded, track disabled, ...) comes
+	// through as MPV_FORMAT_NONE with no data.
+	bool avail = prop->format != MPV_FORMAT_NONE && prop->data != nullptr;
+	auto flag = [&]() { return avail ? *(int *)prop->data : 0; };
+	auto int64 = [&](int64_t def) { return avail ? *(int64_t *)prop->data : def; };
+	auto dbl = [&]() { return avail ? *(double *)prop->data : 0.0; };
+
+	switch (id) {
+	case OBS_PLAYLIST_POS:
+		info.pl_pos = int64(-1);
+		observed_write(W_PLAYLIST_POS, { .i = info.pl_pos });
+		break;
+	case OBS_PLAYLIST_COUNT: info.pl_count = int64(0); break;
+	case OBS_MUTE:
+		info.muted = flag();
+		observed_write(W_MUTE, { .flag = info.muted });
+		break;
+	case OBS_DURATION: info.duration = dbl(); break;
+	case OBS_AUDIO:
+		info.audio_pos = int64(0);
+		observed_write(W_AUDIO, { .i = info.audio_pos });
+		break;
+	case OBS_SUB:
+		info.sub_pos = int64(0);
+		observed_write(W_SUB, { .i = info.sub_pos });
+		break;
+	case OBS_TIME_POS: mpv_time = dbl(); break;
+	case OBS_PAUSE:
+		mpv_paused = flag();
+		observed_write(W_PAUSE, { .flag = mpv_paused });
+		break;
+	case OBS_MEDIA_TITLE:
+		if (avail)
+			info.title = *(char **)prop->data;
+		else
+			info.title.clear();
+		break;
+	case OBS_TRACK_LIST: {
+		TRACE_SCOPE("decode_track_list");
+		auto tracks = std::make_shared<Track_Table>();
+		if (avail)
+			*tracks = decode_track_list((mpv_node *)prop->data);
+		info.audio_count = info.sub_count = 0;
+		for (auto &t : *tracks) {
+			info.audio_count += t.type == TRACK_AUDIO;
+			info.sub_count += t.type == TRACK_SUB;
+		}
+		info.tracks = std::move(tracks);
+		break;
+	}
+	}
+}
+
+void Player::refresh_info()
+{
+	info.exploring = exploring;
+	auto c = clock.anchor();
+	info.c_time = c.at(Canonical_Clock::now_us());
+	info.c_paused = c.paused;
+	info.delay = info.c_time - mpv_time;
+	info.e_time = e_time;
+	info.e_paused = e_paused;
+	info.preview = preview;
+}
+
+void Player::set_wakeup_callback(void (*cb)(void *), void *ctx)
+{
+	MPV_CALL(mpv_set_wakeup_callback, mpv, cb, ctx);
+}
+
 void Player::set_ytdl_format(const char *format)
 {
-		mpv_set_option_string(mpv, "ytdl-raw-options", (std::string("format=") + format).c_str());
+	MPV_CALL(mpv_set_option_string, mpv, "ytdl-raw-options", (std::string("format=") + format).c_str());
+	ytdl_format = format;
+}
+
+void Player::set_headless(bool software_render)
+{
+	const char *options[][2] = {
+		{ "vo", software_render ? "libmpv" : "null" },
+		{ "ao", "null" },
+		{ "hwdec", "no" }
+	};
+	for (auto &o : options)
+		MPV_CALL(mpv_set_option_string, mpv, o[0], o[1]);
+	// Nothing would show explore mode.
+	preview_enabled = false;
 }
 
 void Player::add_file(const char *file)
 {
 	const char *cmd[] = { "loadfile", file, "append", NULL };
-	mpv_command(mpv, cmd);
+	MPV_CALL(mpv_command, mpv, cmd);
+	syncmpv();
+}
+
+// Queues every file with async loadfile/loadlist commands and syncs once
+// when mpv has replied to all of them, instead of a synchronous command and
+// a sync per file.
+void Player::add_files(const std::vector<std::string_view> &files, std::string_view playlist, int64_t request_id)
+{
+	uint64_t id = next_batch_id++;
+	Add_Batch batch = { request_id, 0, 0, 0, std::chrono::steady_clock::now() };
+	MPV_CALL(mpv_get_property, mpv, "playlist-count", MPV_FORMAT_INT64, &batch.count_before);
+
+	for (auto file : files) {
+		const char *cmd[] = { "loadfile", file.data(), "append", NULL };
+		if (MPV_CALL(mpv_command_async, mpv, id, cmd) >= 0)
+			batch.pending++;
+		else
+			batch.failed++;
+	}
+	if (!playlist.empty()) {
+		const char *cmd[] = { "loadlist", playlist.data(), "append", NULL };
+		if (MPV_CALL(mpv_command_async, mpv, id, cmd) >= 0)
+			batch.pending++;
+		else
+			batch.failed++;
+	}
+
+	if (batch.pending == 0)
+		finish_add_batch(batch);
+	else
+		add_batches[id] = batch;
+}
+
+void Player::finish_add_batch(const Add_Batch &batch)
+{
 	syncmpv();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch.start).count();
+	// Entries rather than commands, as one loadlist adds a whole playlist.
+	int64_t count = batch.count_before;
+	MPV_CALL(mpv_get_property, mpv, "playlist-count", MPV_FORMAT_INT64, &count);
+	send_add_files_done(batch.request_id, std::max(count - batch.count_before, (int64_t)0), batch.failed, elapsed);
+}
+
+void Player::handle_command_reply(mpv_event *e)
+{
+	auto it = add_batches.find(e->reply_userdata);
+	if (it == add_batches.end())
+		return;
+
+	auto &batch = it->second;
+	if (e->error < 0)
+		batch.failed++;
+	if (--batch.pending > 0)
+		return;
+
+	finish_add_batch(batch);
+	add_batches.erase(it);
 }
 
 void Player::playlist_clear()
 {
 	const char *clear[] = { "playlist-clear", NULL };
 	const char *remove_current[] = { "playlist-remove", "current", NULL };
-	mpv_command(mpv, clear);
-	mpv_command(mpv, remove_current);
+	MPV_CALL(mpv_command, mpv, clear);
+	MPV_CALL(mpv_command, mpv, remove_current);
 	c_pos = 0;
-	c_time = 0;
-	c_paused = true;
-	exploring = false;
+	resolve_prefetched = -1;
+	clock.set(Canonical_Clock::now_us(), 0, true);
+	end_explore();
 	speed = 1.0;
+	refresh_info();
 }
 
 void Player::create_render_context(mpv_render_context **ctx, mpv_render_param render_params[])
 {
-	mpv_render_context_create(ctx, mpv, render_params);
+	MPV_CALL(mpv_render_context_create, ctx, mpv, render_params);
 }
 
+
 void Player::syncmpv(bool force)
 {
-	int64_t mpv_pos;
-	mpv_get_property(mpv, "playlist-pos", MPV_FORMAT_INT64, &mpv_pos);
-	if (mpv_pos != c_pos) {
-		mpv_set_property(mpv, "playlist-pos", MPV_FORMAT_INT64, &c_pos);
-		exploring = false;
+	// Writes go through to the cached values so that repeated syncs before
+	// the change notification arrives do not write them again.
+	if (info.pl_pos != c_pos) {
+		write_int64(W_PLAYLIST_POS, c_pos);
+		info.pl_pos = c_pos;
+		end_explore();
+		switch_start_us = Canonical_Clock::now_us();
+		switch_started = false;
 	}
 
-	if (exploring)
-		return;
+	// Exploring happens on the preview instance, so this one stays in
+	// sync throughout.
+	auto c = clock.anchor();
+	int c_paused = c.paused;
+	double c_time = c.at(Canonical_Clock::now_us());
+
+	if (mpv_paused != c_paused) {
+		write_flag(W_PAUSE, c_paused);
+		mpv_paused = c_paused;
+	}
 
-	int paused;
-	mpv_get_property(mpv, "pause", MPV_FORMAT_FLAG, &paused);
-	if (paused != c_paused)
-		mpv_set_property(mpv, "pause", MPV_FORMAT_FLAG, &c_paused);
+	// Other than on request, seeking is up to the drift controller.
+	if (force)
+		seek_canonical(c_time);
 
-	double mpv_time;
-	mpv_get_property(mpv, "time-pos", MPV_FORMAT_DOUBLE, &mpv_time);
-	if (force || abs(mpv_time - c_time) > 5)
-		mpv_set_property(mpv, "time-pos", MPV_FORMAT_DOUBLE, &c_time);
+	refresh_info();
 }
 
-PlayerInfo Player::get_info()
+void Player::seek_canonical(double time)
 {
-	PlayerInfo i = { 0 };
+	write_double(W_TIME_POS, time, true);
+	mpv_time = time;
+	seeking = true;
+	seek_start_us = Canonical_Clock::now_us();
+}
 
-	mpv_get_property(mpv, "playlist-pos", MPV_FORMAT_INT64, &i.pl_pos);
-	mpv_get_property(mpv, "playlist-count", MPV_FORMAT_INT64, &i.pl_count);
-	mpv_get_property(mpv, "ao-mute", MPV_FORMAT_FLAG, &i.muted);
+void Player::write_property(Write_Id id, Write_Value v, bool force)
+{
+	auto &w = writes[id];
+	w.value = v;
+	w.force = w.force || force;
+	w.queued = w.force || !w.have_sent || !same_value(write_props[id].format, v, w.sent);
+}
 
-	i.title = title;
+bool Player::same_value(mpv_format format, Write_Value a, Write_Value b)
+{
+	switch (format) {
+	case MPV_FORMAT_FLAG: return a.flag == b.flag;
+	case MPV_FORMAT_INT64: return a.i == b.i;
+	case MPV_FORMAT_DOUBLE: return a.d == b.d;
+	case MPV_FORMAT_STRING: return strcmp(a.s, b.s) == 0;
+	default: return false;
+	}
+}
 
-	mpv_get_property(mpv, "duration", MPV_FORMAT_DOUBLE, &i.duration);
+void Player::flush_writes()
+{
+	for (int id = 0; id < W_COUNT; id++) {
+		auto &w = writes[id];
+		if (!w.queued)
+			continue;
+		w.queued = w.force = false;
+		if (MPV_CALL(mpv_set_property_async, mpv, REPLY_SET_PROPERTY + id, write_props[id].name,
+			write_props[id].format, &w.value) >= 0) {
+			w.sent = w.value;
+			w.have_sent = true;
+		} else {
+			stats.mpv_write_errors++;
+			w.have_sent = false;
+		}
+	}
+}
 
-	i.audio_count = audio_count;
-	i.sub_count = sub_count;
+// mpv reported a value for a property we write, which is no longer the one
+// we sent if something else changed it.
+void Player::observed_write(Write_Id id, Write_Value v)
+{
+	auto &w = writes[id];
+	if (w.have_sent && !same_value(write_props[id].format, v, w.sent))
+		w.have_sent = false;
+}
 
-	mpv_get_property(mpv, "audio", MPV_FORMAT_INT64, &i.audio_pos);
-	mpv_get_property(mpv, "sub", MPV_FORMAT_INT64, &i.sub_pos);
+void Player::handle_set_reply(mpv_event *e)
+{
+	uint64_t id = e->reply_userdata - REPLY_SET_PROPERTY;
+	if (e->reply_userdata < REPLY_SET_PROPERTY || id >= W_COUNT || e->error >= 0)
+		return;
+	stats.mpv_write_errors++;
+	writes[id].have_sent = false;
 
-	i.exploring = exploring;
-	i.c_time = c_time;
-	i.c_paused = c_paused;
-	double mpv_time;
-	mpv_get_property(mpv, "time-pos", MPV_FORMAT_DOUBLE, &mpv_time);
-	if (!exploring) {
-		i.delay = i.c_time - mpv_time;
-	} else {
-		i.e_time = mpv_time;
-		mpv_get_property(mpv, "pause", MPV_FORMAT_FLAG, &i.e_paused);
+	// The value was written through to the cache when it was queued, so
+	// take mpv's back.
+	switch (id) {
+	case W_PLAYLIST_POS:
+		if (MPV_CALL(mpv_get_property, mpv, "playlist-pos", MPV_FORMAT_INT64, &info.pl_pos) < 0)
+			info.pl_pos = -1;
+		break;
+	case W_PAUSE:
+		MPV_CALL(mpv_get_property, mpv, "pause", MPV_FORMAT_FLAG, &mpv_paused);
+		break;
+	case W_TIME_POS:
+		seeking = false;
+		if (MPV_CALL(mpv_get_property, mpv, "time-pos", MPV_FORMAT_DOUBLE, &mpv_time) < 0)
+			mpv_time = 0;
+		break;
+	case W_MUTE:
+		MPV_CALL(mpv_get_property, mpv, "ao-mute", MPV_FORMAT_FLAG, &info.muted);
+		break;
+	default:
+		break;
 	}
+}
 
-	return i;
+bool Player::set_sync_controller(std::string_view name)
+{
+	auto d = make_drift_controller(name);
+	if (!d)
+		return false;
+	drift = std::move(d);
+	return true;
 }
 
-void Player::update()
+const PlayerInfo &Player::get_info()
 {
-	int64_t current_time = mpv_get_time_us(mpv);
-	double dt = (double)(current_time - last_time) / 1000000;
-	last_time = current_time;
-	if (!c_paused)
-		c_time += dt;
+	return info;
+}
+
+void Player::handle_event(mpv_event *e)
+{
+	switch (e->event_id) {
+	case MPV_EVENT_SHUTDOWN:
+		break;
+	case MPV_EVENT_LOG_MESSAGE:
+		break;
+	case MPV_EVENT_GET_PROPERTY_REPLY:
+		break;
+	case MPV_EVENT_SET_PROPERTY_REPLY:
+		handle_set_reply(e);
+		break;
+	case MPV_EVENT_COMMAND_REPLY:
+		handle_command_reply(e);
+		break;
+	case MPV_EVENT_START_FILE:
+		if (switch_start_us < 0)
+			switch_start_us = Canonical_Clock::now_us();
+		switch_started = true;
+		break;
+	case MPV_EVENT_END_FILE:
+		break;
+	case MPV_EVENT_FILE_LOADED: {
+		info.media_path = get_string(mpv, "stream-open-filename");
+		auto headers = std::make_shared<Stream_Headers>();
+		headers->user_agent = get_string(mpv, "user-agent");
+		headers->referrer = get_string(mpv, "referrer");
+		headers->fields = get_string_list(mpv, "http-header-fields");
+		info.media_headers = std::move(headers);
+		// The preview's file is of no more use; its cache can go.
+		if (!preview_path.empty() && preview_path != info.media_path) {
+			const char *stop[] = { "stop", nullptr };
+			MPV_CALL(mpv_command_async, preview, 0, stop);
+			preview_path.clear();
+			preview_loaded = false;
+		}
+		syncmpv();
+		break;
+	}
+	case MPV_EVENT_IDLE:
+		switch_start_us = -1;
+		break;
+	case MPV_EVENT_TICK:
+		break;
+	case MPV_EVENT_CLIENT_MESSAGE:
+		break;
+	case MPV_EVENT_VIDEO_RECONFIG:
+		break;
+	case MPV_EVENT_SEEK:
+		break;
+	case MPV_EVENT_PLAYBACK_RESTART:
+		if (switch_start_us >= 0 && switch_started) {
+			double t = (Canonical_Clock::now_us() - switch_start_us) / 1e6;
+			stats.switches++;
+			stats.switch_time_total += t;
+			stats.switch_time_max = std::max(stats.switch_time_max, t);
+			switch_start_us = -1;
+		}
+		if (seeking) {
+			seeking = false;
+			drift->seek_done((Canonical_Clock::now_us() - seek_start_us) / 1e6);
+			drift->reset();
+		}
+		syncmpv();
+		break;
+	case MPV_EVENT_PROPERTY_CHANGE:
+		handle_property_change(e->reply_userdata, (mpv_event_property *)e->data);
+		break;
+	case MPV_EVENT_HOOK: {
+		auto hook = (mpv_event_hook *)e->data;
+		if (strcmp(hook->name, "on_load") == 0)
+			handle_load_hook(hook->id);
+		break;
+	}
+	case MPV_EVENT_QUEUE_OVERFLOW:
+		break;
+	default:
+		break;
+	}
+}
 
-	auto info = get_info();
+// mpv_wait_event, counted and traced like MPV_CALL. Waiting with a timeout
+// is idle time rather than work and is traced under its own name.
+mpv_event *Player::next_event(mpv_handle *handle, double timeout)
+{
+	stats.mpv_calls++;
+	TRACE_SCOPE(timeout == 0 ? "mpv_wait_event" : "mpv_wait_event (idle)");
+	return mpv_wait_event(handle, timeout);
+}
 
-	auto clamp = [](double lo, double x, double hi) { return std::min(std::max(lo, x), hi); };
+// Blocks until mpv has an event, wakeup() is called or the timeout in
+// seconds runs out (never if negative), and handles the event if any.
+void Player::wait(double timeout)
+{
+	handle_event(next_event(mpv, timeout));
+}
 
-	if ((speed != 1.0 && info.delay < -0.3) || info.delay < -0.5)
-		speed = 1.0 - 0.3*clamp(0, -info.delay/10, 1);
-	else if ((speed != 1.0 && info.delay >= 0.3) || info.delay >= 0.5)
-		speed = 1.0 + 0.3*clamp(0, info.delay/10, 1);
-	else
-		speed = 1.0;
-	mpv_set_property(mpv, "speed", MPV_FORMAT_DOUBLE, &speed);
+// Not counted in stats.mpv_calls, which belongs to the control thread.
+void Player::wakeup()
+{
+	TRACE_SCOPE("mpv_wakeup");
+	mpv_wakeup(mpv);
+}
 
+void Player::update()
+{
 	mpv_event *e;
-	while (e = mpv_wait_event(mpv, 0), e->event_id != MPV_EVENT_NONE) {
-		switch (e->event_id) {
-		case MPV_EVENT_SHUTDOWN:
-			break;
-		case MPV_EVENT_LOG_MESSAGE:
-			break;
-		case MPV_EVENT_GET_PROPERTY_REPLY:
-			break;
-		case MPV_EVENT_SET_PROPERTY_REPLY:
-			break;
-		case MPV_EVENT_COMMAND_REPLY:
-			break;
-		case MPV_EVENT_START_FILE:
-			break;
-		case MPV_EVENT_END_FILE:
-			break;
-		case MPV_EVENT_FILE_LOADED: {
-			char *mpv_title;
-			mpv_get_property(mpv, "media-title", MPV_FORMAT_STRING, &mpv_title);
-			title = std::string(mpv_title);
-			mpv_free(mpv_title);
-
-			mpv_get_track_counts(mpv, &audio_count, &sub_count);
-
-			syncmpv();
-			break;
+	while (e = next_event(mpv, 0), e->event_id != MPV_EVENT_NONE)
+		handle_event(e);
+	while (preview != nullptr && (e = next_event(preview, 0), e->event_id != MPV_EVENT_NONE))
+		handle_preview_event(e);
+	if (resolver != nullptr)
+		handle_resolved();
+	refresh_info();
+
+	int64_t now = Canonical_Clock::now_us();
+	double dt = (now - last_update_us) / 1e6;
+	last_update_us = now;
+	// A seek that never restarts playback, e.g. because the file failed to
+	// load, should not stop syncing for good.
+	if (seeking && now - seek_start_us > 10000000)
+		seeking = false;
+
+	speed = 1.0;
+	if (!seeking && info.pl_pos == c_pos) {
+		TRACE_SCOPE("drift_controller");
+		Drift_Action a = drift->update(info.delay, dt, info.c_paused);
+		if (a.seek)
+			seek_canonical(info.c_time + (info.c_paused ? 0 : a.seek_ahead));
+		else
+			speed = a.speed;
+	}
+	write_double(W_SPEED, speed);
+
+	if (!info.c_paused)
+		playing_us = now;
+	bool prefetch = prefetch_wanted();
+	if (prefetch && !prefetching)
+		stats.prefetches++;
+	prefetching = prefetch;
+	write_flag(W_PREFETCH, prefetch);
+	if (prefetch && resolver != nullptr)
+		prefetch_resolve();
+}
+
+void Player::set_resolver(Resolver *r)
+{
+	resolver = r;
+	// Runs before mpv opens anything. mpv's ytdl hook only takes on web
+	// URLs once opening them directly has failed, so it never sees those
+	// resolved here.
+	MPV_CALL(mpv_hook_add, mpv, 0, "on_load", 0);
+}
+
+void Player::handle_load_hook(uint64_t id)
+{
+	std::string url = get_string(mpv, "stream-open-filename");
+
+	// Unless it is in the cache, the file waits for the worker.
+	if (Resolver::handles(url)) {
+		if (const Resolved *r = resolver->lookup(url, ytdl_format)) {
+			apply_resolved(*r);
+		} else if (resolver->request(url, ytdl_format)) {
+			load_hooks.push_back({ id, url, ytdl_format });
+			return;
+		}
+	}
+	MPV_CALL(mpv_hook_continue, mpv, id);
+}
+
+// Has mpv open the stream rather than the page. Only while an on_load hook
+// holds the file.
+void Player::apply_resolved(const Resolved &r)
+{
+	TRACE_SCOPE("apply_resolved");
+	auto set = [&](const char *name, const std::string &value) {
+		if (value.empty())
+			return;
+		MPV_CALL(mpv_set_property_string, mpv, name, value.c_str());
+	};
+	set("stream-open-filename", r.stream_url);
+	set("file-local-options/force-media-title", r.title);
+	set("file-local-options/user-agent", r.headers.user_agent);
+	set("file-local-options/referrer", r.headers.referrer);
+	if (!r.headers.fields.empty())
+		set_string_list(mpv, "file-local-options/http-header-fields", r.headers.fields);
+}
+
+// Lets go of the files and answers the requests the worker has results for.
+// A file whose URL could not be resolved is opened as it is, which leaves
+// it to mpv's ytdl hook.
+void Player::handle_resolved()
+{
+	for (auto &r : resolver->take_finished()) {
+		for (auto it = load_hooks.begin(); it != load_hooks.end();) {
+			if (it->url != r.url || it->format != r.format) {
+				++it;
+				continue;
+			}
+			if (r.ok)
+				apply_resolved(r);
+			MPV_CALL(mpv_hook_continue, mpv, it->id);
+			it = load_hooks.erase(it);
 		}
-		case MPV_EVENT_IDLE:
-			break;
-		case MPV_EVENT_TICK:
-			break;
-		case MPV_EVENT_CLIENT_MESSAGE:
-			break;
-		case MPV_EVENT_VIDEO_RECONFIG:
-			break;
-		case MPV_EVENT_SEEK:
-			break;
-		case MPV_EVENT_PLAYBACK_RESTART:
-			syncmpv();
-			break;
-		case MPV_EVENT_PROPERTY_CHANGE:
-			break;
-		case MPV_EVENT_QUEUE_OVERFLOW:
-			break;
-		default:
-			break;
+		for (auto it = resolve_requests.begin(); it != resolve_requests.end();) {
+			if (it->url != r.url || it->format != r.format) {
+				++it;
+				continue;
+			}
+			send_resolved(it->request_id, r);
+			it = resolve_requests.erase(it);
 		}
 	}
 }
 
+void Player::resolve(std::string_view url, int64_t request_id)
+{
+	if (resolver != nullptr) {
+		if (const Resolved *r = resolver->lookup(url, ytdl_format)) {
+			send_resolved(request_id, *r);
+			return;
+		}
+		if (resolver->request(url, ytdl_format)) {
+			resolve_requests.push_back({ request_id, std::string(url), ytdl_format });
+			return;
+		}
+	}
+	Resolved r;
+	r.url = url;
+	r.format = ytdl_format;
+	r.error = "no resolver";
+	send_resolved(request_id, r);
+}
+
+// mpv's prefetching opens the next entry's URL as it is, so for one that
+// needs resolving that is done here, into the cache, once per entry.
+void Player::prefetch_resolve()
+{
+	if (resolve_prefetched == c_pos + 1)
+		return;
+	resolve_prefetched = c_pos + 1;
+
+	char name[48];
+	snprintf(name, sizeof name, "playlist/%lld/filename", (long long)(c_pos + 1));
+	std::string path = get_string(mpv, name);
+	if (Resolver::handles(path) && resolver->lookup(path, ytdl_format) == nullptr)
+		resolver->request(path, ytdl_format);
+}
+
+// mpv opens the next entry, running ytdl and filling the start of its
+// cache, once the current one is read to the end, but only while
+// prefetch-playlist is on. It is on only when a switch is likely soon, so
+// that jumping around the playlist does not open entries for nothing.
+bool Player::prefetch_wanted()
+{
+	if (c_pos + 1 >= info.pl_count || info.pl_pos != c_pos)
+		return false;
+	bool near_end = info.duration > 0 && info.duration - info.c_time < prefetch_lead;
+	bool long_pause = info.c_paused
+		&& Canonical_Clock::now_us() - playing_us > prefetch_pause * 1e6;
+	return near_end || long_pause;
+}
+
+std::optional<time_point> Player::resolve_deadline()
+{
+	if (resolver == nullptr)
+		return std::nullopt;
+	return resolver->next_timeout();
+}
+
+std::optional<time_point> Player::prefetch_deadline()
+{
+	if (prefetching || !info.c_paused || c_pos + 1 >= info.pl_count || info.pl_pos != c_pos)
+		return std::nullopt;
+	return time_point(std::chrono::microseconds(playing_us + (int64_t)(prefetch_pause * 1e6)));
+}
+
 std::string statestr(double time, int paused, int64_t pl_pos, int64_t pl_count)
 {
 	char buf[50];
@@ -215,83 +824,202 @@ std::string statestr(double time, int paused, int64_t pl_pos, int64_t pl_count)
 void Player::explore()
 {
 	exploring = true;
+	e_time = mpv_time;
+	e_paused = mpv_paused;
+	if (preview == nullptr && preview_enabled)
+		create_preview();
+	if (preview_rendering)
+		show_preview();
+	refresh_info();
 }
 
-void Player::explore_accept()
+// Made on the first explore. It can only open anything once the render
+// thread has a render context for it, which preview_ready() says.
+void Player::create_preview()
 {
+	TRACE_SCOPE("create_preview");
+	preview = MPV_CALL(mpv_create);
+	for (auto &o : preview_options)
+		MPV_CALL(mpv_set_option_string, preview, o[0], o[1]);
+	MPV_CALL(mpv_initialize, preview);
+	MPV_CALL(mpv_observe_property, preview, OBS_TIME_POS, "time-pos", MPV_FORMAT_DOUBLE);
+	// Its events are handled along with the main instance's, so they wake
+	// the same wait.
+	MPV_CALL(mpv_set_wakeup_callback, preview, [](void *m) { mpv_wakeup((mpv_handle *)m); }, mpv);
+}
+
+void Player::preview_ready()
+{
+	if (preview_rendering)
+		return;
+	preview_rendering = true;
+	if (exploring)
+		show_preview();
+	refresh_info();
+}
+
+// Has the preview show the explore time, loading the file if it has
+// another one.
+void Player::show_preview()
+{
+	if (preview_path != info.media_path) {
+		load_preview();
+	} else {
+		// Still loading, it seeks once loaded.
+		MPV_CALL(mpv_set_property_async, preview, 0, "pause", MPV_FORMAT_FLAG, &e_paused);
+		if (preview_loaded)
+			MPV_CALL(mpv_set_property_async, preview, 0, "time-pos", MPV_FORMAT_DOUBLE, &e_time);
+	}
+}
+
+// Opens the canonical entry in the preview instance where explore mode
+// starts, with the headers a resolved stream needs.
+void Player::load_preview()
+{
+	TRACE_SCOPE("load_preview");
+	preview_path = info.media_path;
+	preview_loaded = false;
+	if (preview_path.empty())
+		return;
+	if (info.media_headers != nullptr) {
+		auto &h = *info.media_headers;
+		MPV_CALL(mpv_set_property_string, preview, "user-agent", h.user_agent.c_str());
+		MPV_CALL(mpv_set_property_string, preview, "referrer", h.referrer.c_str());
+		set_string_list(preview, "http-header-fields", h.fields);
+	}
+	char start[32];
+	snprintf(start, sizeof start, "%.3f", e_time);
+	preview_start = e_time;
+	const char *cmd[] = { "loadfile", preview_path.c_str(), nullptr };
+	MPV_CALL(mpv_set_property_string, preview, "start", start);
+	MPV_CALL(mpv_set_property, preview, "pause", MPV_FORMAT_FLAG, &e_paused);
+	MPV_CALL(mpv_command_async, preview, 0, cmd);
+}
+
+void Player::handle_preview_event(mpv_event *e)
+{
+	switch (e->event_id) {
+	case MPV_EVENT_FILE_LOADED:
+		preview_loaded = true;
+		// Moved on while it was loading.
+		if (e_time != preview_start)
+			MPV_CALL(mpv_set_property_async, preview, 0, "time-pos", MPV_FORMAT_DOUBLE, &e_time);
+		break;
+	case MPV_EVENT_END_FILE:
+		preview_loaded = false;
+		// Tried again on the next explore.
+		if (((mpv_event_end_file *)e->data)->reason == MPV_END_FILE_REASON_ERROR)
+			preview_path.clear();
+		break;
+	case MPV_EVENT_PROPERTY_CHANGE: {
+		auto prop = (mpv_event_property *)e->data;
+		if (e->reply_userdata == OBS_TIME_POS && prop->format == MPV_FORMAT_DOUBLE && exploring)
+			e_time = *(double *)prop->data;
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+// Leaves explore mode. The preview keeps its file, paused, in case it is
+// entered again.
+void Player::end_explore()
+{
+	if (!exploring)
+		return;
 	exploring = false;
-	mpv_get_property(mpv, "time-pos", MPV_FORMAT_DOUBLE, &c_time);
-	mpv_get_property(mpv, "pause", MPV_FORMAT_FLAG, &c_paused);
-	send_control(c_pos, c_time, c_paused);
+	e_paused = true;
+	if (preview != nullptr)
+		MPV_CALL(mpv_set_property_async, preview, 0, "pause", MPV_FORMAT_FLAG, &e_paused);
+}
+
+// The canonical playback was never moved, so this is the one seek.
+void Player::explore_accept()
+{
+	double time = e_time;
+	int paused = e_paused;
+	end_explore();
+	clock.set(Canonical_Clock::now_us(), time, paused);
+	syncmpv(true);
+	send_control(c_pos, info.c_time, info.c_paused);
 }
 
 void Player::explore_cancel()
 {
-	exploring = false;
-	syncmpv();
+	end_explore();
+	refresh_info();
 }
 
 void Player::toggle_mute()
 {
-	int muted;
-	mpv_get_property(mpv, "ao-mute", MPV_FORMAT_FLAG, &muted);
-	muted = !muted;
-	mpv_set_property(mpv, "ao-mute", MPV_FORMAT_FLAG, &muted);
+	info.muted = !info.muted;
+	write_flag(W_MUTE, info.muted);
 }
 
 void Player::set_audio(int64_t track)
 {
-	mpv_set_property(mpv, "audio", MPV_FORMAT_INT64, &track);
+	write_int64(W_AUDIO, track);
 }
 
 void Player::set_sub(int64_t track)
 {
-	mpv_set_property(mpv, "sub", MPV_FORMAT_INT64, &track);
+	write_int64(W_SUB, track);
 }
 
 void Player::pause(int paused)
 {
-	c_paused = paused;
+	clock.set_paused(Canonical_Clock::now_us(), paused);
 	syncmpv();
 }
 
 void Player::set_time(double time)
 {
-	c_time = time;
+	clock.set(Canonical_Clock::now_us(), time, clock.paused());
 	syncmpv();
 }
 
 void Player::set_pl_pos(int64_t pl_pos)
 {
 	c_pos = pl_pos;
-	c_paused = true, c_time = 0;
+	clock.set(Canonical_Clock::now_us(), 0, true);
 	syncmpv();
 }
 
 void Player::set_canonical(int64_t pl_pos, bool paused, double time)
 {
 	c_pos = pl_pos;
-	c_paused = paused;
-	c_time = time;
+	clock.set(Canonical_Clock::now_us(), time, paused);
 	syncmpv();
 }
 
 void Player::toggle_explore_paused()
 {
 	assert(exploring);
-	int paused;
-	mpv_get_property(mpv, "pause", MPV_FORMAT_FLAG, &paused);
-	paused = !paused;
-	mpv_set_property(mpv, "pause", MPV_FORMAT_FLAG, &paused);
+	e_paused = !e_paused;
+	if (preview != nullptr)
+		MPV_CALL(mpv_set_property_async, preview, 0, "pause", MPV_FORMAT_FLAG, &e_paused);
+	refresh_info();
 }
 
 void Player::set_explore_time(double time)
 {
 	assert(exploring);
-	mpv_set_property(mpv, "time-pos", MPV_FORMAT_DOUBLE, &time);
+	e_time = time;
+	// Until the file is loaded, loading catches up with it.
+	if (preview_loaded)
+		MPV_CALL(mpv_set_property_async, preview, 0, "time-pos", MPV_FORMAT_DOUBLE, &e_time);
+	refresh_info();
 }
 
 void Player::force_sync()
 {
 	syncmpv(true);
+}
+
+void Player::set_video(bool enabled)
+{
+	write_string(W_VIDEO, enabled ? "auto" : "no");
+	if (enabled)
+		syncmpv(true);
 }
\ No newline at end of file
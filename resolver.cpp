@@ -0,0 +1,266 @@
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <thread>
+#ifndef _WIN32
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+#include "resolver.h"
+#include "json.h"
+
+using json = nlohmann::json;
+
+// Stream URLs of the big sites stay valid for hours; this is well inside.
+constexpr auto cache_ttl = std::chrono::minutes(30);
+constexpr size_t cache_size = 256;
+// After this long mpv is let go to try the URL itself.
+constexpr auto request_timeout = std::chrono::seconds(20);
+
+// Links straight to media or playlists mpv reads, which it opens at once;
+// its own ytdl hook only runs after that failed.
+static bool is_direct_media(std::string_view url)
+{
+	url = url.substr(0, url.find_first_of("?#"));
+	url = url.substr(url.find_last_of('/') + 1);
+	size_t dot = url.find_last_of('.');
+	if (dot == std::string_view::npos)
+		return false;
+	std::string ext(url.substr(dot + 1));
+	for (auto &c : ext)
+		c = tolower((unsigned char)c);
+	for (const char *media : { "mp4", "m4v", "mkv", "webm", "mov", "avi", "wmv", "flv", "ts", "m2ts",
+			"mpg", "mpeg", "ogv", "ogg", "oga", "opus", "mp3", "m4a", "aac", "flac", "wav", "wma",
+			"m3u", "m3u8", "mpd" })
+		if (ext == media)
+			return true;
+	return false;
+}
+
+bool Resolver::handles(std::string_view url)
+{
+	if (url.substr(0, 7) == "ytdl://")
+		return true;
+	for (std::string_view scheme : { "http://", "https://" })
+		if (url.substr(0, scheme.size()) == scheme)
+			return !is_direct_media(url.substr(scheme.size()));
+	return false;
+}
+
+#ifdef _WIN32
+bool Resolver::start(const std::string &command, void (*wake)(void *), void *ctx)
+{
+	return false;
+}
+
+static long read_some(int fd, char *buf, size_t size) { return -1; }
+static bool send_all(int fd, const std::string &line) { return false; }
+static void close_fd(int fd) {}
+#else
+extern char **environ;
+
+bool Resolver::start(const std::string &command, void (*wake_cb)(void *), void *ctx)
+{
+	// A socket rather than pipes so that writing to a worker that died
+	// fails with EPIPE instead of raising SIGPIPE.
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return false;
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, sv[1], STDOUT_FILENO);
+	const char *argv[] = { "sh", "-c", command.c_str(), nullptr };
+	pid_t pid;
+	int err = posix_spawn(&pid, "/bin/sh", &actions, nullptr, const_cast<char **>(argv), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(sv[1]);
+	if (err != 0) {
+		close(sv[0]);
+		return false;
+	}
+
+	fd = sv[0];
+	wake = wake_cb;
+	wake_ctx = ctx;
+	std::thread(&Resolver::read_replies, this).detach();
+	return true;
+}
+
+static long read_some(int fd, char *buf, size_t size)
+{
+	ssize_t n;
+	do
+		n = read(fd, buf, size);
+	while (n < 0 && errno == EINTR);
+	return n;
+}
+
+static bool send_all(int fd, const std::string &line)
+{
+	size_t off = 0;
+	while (off < line.size()) {
+		ssize_t n = send(fd, line.data() + off, line.size() - off, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return false;
+		off += n;
+	}
+	return true;
+}
+
+static void close_fd(int fd)
+{
+	close(fd);
+}
+#endif
+
+void Resolver::read_replies()
+{
+	std::string buf;
+	char chunk[4096];
+	while (1) {
+		long n = read_some(fd, chunk, sizeof chunk);
+		if (n <= 0)
+			break;
+		buf.append(chunk, n);
+
+		size_t start = 0, end;
+		bool any = false;
+		while ((end = buf.find('\n', start)) != std::string::npos) {
+			Resolved r;
+			try {
+				json j = json::parse(buf.begin() + start, buf.begin() + end);
+				// The worker leaves out or nulls what it does not know.
+				auto text = [&](const char *key) {
+					auto it = j.find(key);
+					return it != j.end() && it->is_string() ? it->get<std::string>() : std::string();
+				};
+				auto d = j.find("duration");
+				auto ok = j.find("ok");
+				r.url = j.at("url").get<std::string>();
+				r.format = text("format");
+				r.ok = ok != j.end() && ok->is_boolean() && ok->get<bool>();
+				r.stream_url = text("stream_url");
+				r.title = text("title");
+				r.uploader = text("uploader");
+				r.uploader_url = text("uploader_url");
+				r.duration = d != j.end() && d->is_number() ? d->get<double>() : 0;
+				r.headers.user_agent = text("user_agent");
+				r.headers.referrer = text("referer");
+				auto fields = j.find("header_fields");
+				if (fields != j.end() && fields->is_array())
+					for (auto &f : *fields)
+						if (f.is_string())
+							r.headers.fields.push_back(f.get<std::string>());
+				r.error = text("error");
+				if (r.ok && r.stream_url.empty()) {
+					r.ok = false;
+					r.error = "no stream url";
+				}
+				std::lock_guard<std::mutex> guard(lock);
+				replies.push_back(std::move(r));
+				any = true;
+			} catch (std::exception &e) {
+				fprintf(stderr, "resolver: %s\n", e.what());
+			}
+			start = end + 1;
+		}
+		buf.erase(0, start);
+		if (any)
+			wake(wake_ctx);
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	closed = true;
+	wake(wake_ctx);
+}
+
+const Resolved *Resolver::lookup(std::string_view url, std::string_view format)
+{
+	auto it = cache.find(Key(url, format));
+	if (it == cache.end())
+		return nullptr;
+	if (clock::now() >= it->second.expires) {
+		cache.erase(it);
+		return nullptr;
+	}
+	return &it->second.r;
+}
+
+bool Resolver::request(std::string_view url, std::string_view format)
+{
+	if (!running())
+		return false;
+	Key key(url, format);
+	if (in_flight.count(key))
+		return true;
+
+	json req;
+	req["url"] = key.first;
+	req["format"] = key.second;
+	if (!send_all(fd, req.dump() + '\n'))
+		return false;
+	in_flight[std::move(key)] = clock::now();
+	return true;
+}
+
+std::optional<Resolver::clock::time_point> Resolver::next_timeout() const
+{
+	std::optional<clock::time_point> first;
+	for (auto &r : in_flight)
+		if (!first.has_value() || r.second < *first)
+			first = r.second;
+	if (!first.has_value())
+		return std::nullopt;
+	return *first + request_timeout;
+}
+
+std::vector<Resolved> Resolver::take_finished()
+{
+	std::vector<Resolved> done;
+	bool lost;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done.swap(replies);
+		lost = closed;
+	}
+
+	auto now = clock::now();
+	for (auto &r : done) {
+		Key key(r.url, r.format);
+		in_flight.erase(key);
+		if (!r.ok)
+			continue;
+		if (cache.size() >= cache_size) {
+			auto oldest = cache.begin();
+			for (auto it = cache.begin(); it != cache.end(); ++it)
+				if (it->second.expires < oldest->second.expires)
+					oldest = it;
+			cache.erase(oldest);
+		}
+		cache[key] = { r, now + cache_ttl };
+	}
+
+	for (auto it = in_flight.begin(); it != in_flight.end();) {
+		if (!lost && now - it->second < request_timeout) {
+			++it;
+			continue;
+		}
+		Resolved r;
+		r.url = it->first.first;
+		r.format = it->first.second;
+		r.error = lost ? "resolver exited" : "timed out";
+		done.push_back(std::move(r));
+		it = in_flight.erase(it);
+	}
+	if (lost && fd >= 0) {
+		close_fd(fd);
+		fd = -1;
+	}
+	return done;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The request headers a stream wants, split the way mpv takes them.
+struct Stream_Headers {
+	std::string user_agent, referrer;
+	// The others, e.g. cookies, as "Name: value".
+	std::vector<std::string> fields;
+};
+
+// What the resolver worker made of a URL for a ytdl format.
+struct Resolved {
+	std::string url, format;
+	bool ok = false;
+	// What mpv should open instead of url; an edl:// URL when video and
+	// audio come separately.
+	std::string stream_url;
+	std::string title, uploader, uploader_url;
+	double duration = 0;
+	Stream_Headers headers;
+	std::string error;
+};
+
+// Turns web page URLs into stream URLs through one long-lived worker process
+// (ytdl_resolver.py), so youtube-dl is started and its extractors loaded
+// once rather than for every file. The worker reads requests as JSON lines
+// on stdin and answers on stdout, in any order:
+//
+//	{"url": "...", "format": "..."}
+//	{"url": "...", "format": "...", "ok": true, "stream_url": "...", "title": "...", ...}
+//
+// so any program speaking that can stand in for it, e.g. a stub in tests.
+// Successful results are cached for a while by URL and format.
+//
+// Used from the control thread only. Replies are read on a thread of their
+// own, which calls wake when one is in.
+class Resolver {
+public:
+	// Runs command with sh -c. Returns false if it could not be started,
+	// which also happens on platforms without support.
+	bool start(const std::string &command, void (*wake)(void *), void *ctx);
+	bool running() const { return fd >= 0; }
+
+	// Whether url is something for the worker rather than a local file or
+	// a stream mpv can open itself, going by its extension.
+	static bool handles(std::string_view url);
+
+	// An unexpired cached result, or nullptr.
+	const Resolved *lookup(std::string_view url, std::string_view format);
+	// Asks the worker, unless the same request is out already. False if
+	// the worker cannot be asked, in which case no answer comes.
+	bool request(std::string_view url, std::string_view format);
+	// The replies that came in since the last call, and failures for
+	// requests that took too long or were lost with the worker.
+	std::vector<Resolved> take_finished();
+	// When the oldest request times out, so take_finished can be called
+	// then.
+	std::optional<std::chrono::steady_clock::time_point> next_timeout() const;
+
+private:
+	using Key = std::pair<std::string, std::string>;
+	using clock = std::chrono::steady_clock;
+
+	void read_replies();
+
+	int fd = -1;
+	void (*wake)(void *) = nullptr;
+	void *wake_ctx = nullptr;
+
+	struct Cache_Entry {
+		Resolved r;
+		clock::time_point expires;
+	};
+	std::map<Key, Cache_Entry> cache;
+	std::map<Key, clock::time_point> in_flight;
+
+	// Shared with the reply thread.
+	std::mutex lock;
+	std::vector<Resolved> replies;
+	bool closed = false;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Bounded single-producer/single-consumer queue. Elements are written and
+// read in place in their slot, so nothing is copied between the threads and
+// a slot's resources (string capacity etc.) are reused on the next lap.
+template <typename T, size_t N>
+class Spsc_Ring {
+	static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+	// Producer: the next free slot, or nullptr if the ring is full. The
+	// slot becomes visible to the consumer on commit().
+	T *write_slot()
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == N)
+			return nullptr;
+		return &slots[h & (N - 1)];
+	}
+
+	void commit()
+	{
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Consumer: the oldest committed slot, or nullptr if the ring is empty.
+	// The slot is handed back to the producer on release().
+	T *read_slot()
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return nullptr;
+		return &slots[t & (N - 1)];
+	}
+
+	void release()
+	{
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	size_t depth() const
+	{
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+
+private:
+	std::array<T, N> slots;
+	alignas(64) std::atomic<size_t> head = 0;
+	alignas(64) std::atomic<size_t> tail = 0;
+};
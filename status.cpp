@@ -0,0 +1,74 @@
+#include <math.h>
+#include "moov.h"
+#include "ipc.h"
+
+void Status_Subscription::subscribe(double max_rate, double heartbeat_interval)
+{
+	active = true;
+	full = true;
+	min_interval = max_rate > 0 ? 1.0 / max_rate : 0;
+	heartbeat = std::max(heartbeat_interval, 0.0);
+}
+
+void Status_Subscription::unsubscribe()
+{
+	active = false;
+}
+
+void Status_Subscription::update(const PlayerInfo &info, time_point now)
+{
+	if (!active)
+		return;
+
+	double since_sent = std::chrono::duration<double>(now - last_sent).count();
+	if (!full && since_sent < min_interval)
+		return;
+	if (heartbeat > 0 && since_sent >= heartbeat)
+		full = true;
+
+	// The client extrapolates from when it last got the time, which other
+	// fields going out since don't change.
+	double since_time = std::chrono::duration<double>(now - time_sent_at).count();
+	double expected = paused ? time : time + since_time;
+	bool send_time = full || info.c_paused != paused || info.pl_pos != pl_pos
+		|| fabs(info.c_time - expected) > 0.25;
+
+	nlohmann::json msg;
+	msg["type"] = "status_update";
+	if (full || info.pl_pos != pl_pos)
+		msg["playlist_position"] = pl_pos = info.pl_pos;
+	if (full || info.pl_count != pl_count)
+		msg["playlist_count"] = pl_count = info.pl_count;
+	if (full || info.c_paused != paused)
+		msg["paused"] = (bool)(paused = info.c_paused);
+	if (send_time) {
+		msg["time"] = time = info.c_time;
+		time_sent_at = now;
+	}
+	if (full || fabs(info.delay - delay) > 0.5)
+		msg["delay"] = delay = info.delay;
+
+	if (msg.size() == 1)
+		return;
+	// Each update only has what changed, so after one was dropped because
+	// the client is behind, the next has everything.
+	last_sent = now;
+	full = !ipc_send(msg, OUTPUT_DROPPABLE);
+}
+
+std::optional<time_point> Status_Subscription::next_update(time_point now) const
+{
+	if (!active)
+		return std::nullopt;
+	auto after = [&](double s) {
+		return last_sent + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(s));
+	};
+	// Wake once the rate cap allows sending again, so a change held back by
+	// it goes out even if nothing else wakes the loop.
+	if (full || now < after(min_interval))
+		return std::max(now, after(min_interval));
+	if (heartbeat > 0)
+		return after(heartbeat);
+	return std::nullopt;
+}
@@ -0,0 +1,109 @@
+#include <math.h>
+#include <algorithm>
+
+#include "sync.h"
+
+static double clamp(double lo, double x, double hi)
+{
+	return std::min(std::max(lo, x), hi);
+}
+
+Drift_Action Bang_Bang_Controller::update(double delay, double /*dt*/, bool /*paused*/)
+{
+	if ((speed != 1.0 && delay < -0.3) || delay < -0.5)
+		speed = 1.0 - 0.3*clamp(0, -delay/10, 1);
+	else if ((speed != 1.0 && delay >= 0.3) || delay >= 0.5)
+		speed = 1.0 + 0.3*clamp(0, delay/10, 1);
+	else
+		speed = 1.0;
+
+	Drift_Action a;
+	a.speed = speed;
+	a.seek = fabs(delay) > 5;
+	return a;
+}
+
+void Bang_Bang_Controller::reset()
+{
+	speed = 1.0;
+}
+
+Drift_Action Pid_Controller::update(double delay, double dt, bool paused)
+{
+	Drift_Action a;
+	if (paused || fabs(delay) > seek_threshold) {
+		a.seek = fabs(delay) > (paused ? 0.1 : seek_threshold);
+		reset();
+		return a;
+	}
+
+	// The delay is only as fresh as the last time-pos update, so the
+	// derivative is smoothed over a few of them.
+	if (have_prev && dt > 0) {
+		double d = (delay - prev_delay) / dt;
+		derivative += (d - derivative) * std::min(1.0, dt / 0.5);
+	}
+	prev_delay = delay;
+	have_prev = true;
+
+	// Inside the dead band the integral is let go slowly, otherwise what is
+	// left of it after converging keeps pushing the delay out again.
+	double e = delay;
+	if (fabs(delay) < dead_band) {
+		e = 0;
+		integral -= integral * std::min(1.0, dt / 10);
+	}
+	double u = kp*e + ki*integral + kd*derivative;
+	if (fabs(u) < max_dev)
+		integral += e * dt;
+	a.speed = 1.0 + clamp(-max_dev, u, max_dev);
+	return a;
+}
+
+void Pid_Controller::reset()
+{
+	integral = 0;
+	derivative = 0;
+	have_prev = false;
+}
+
+Drift_Action Seek_If_Cheaper_Controller::update(double delay, double dt, bool paused)
+{
+	Drift_Action a;
+	double catch_up = fabs(delay) / max_dev;
+	if (paused) {
+		a.seek = fabs(delay) > 0.1;
+	} else if (fabs(delay) >= min_seek && cost * stall_weight < catch_up) {
+		a.seek = true;
+		a.seek_ahead = cost;
+	} else {
+		pid.max_dev = max_dev;
+		pid.seek_threshold = INFINITY;
+		return pid.update(delay, dt, paused);
+	}
+	pid.reset();
+	return a;
+}
+
+void Seek_If_Cheaper_Controller::reset()
+{
+	pid.reset();
+}
+
+void Seek_If_Cheaper_Controller::seek_done(double seconds)
+{
+	// A single slow seek, e.g. over the network, should not stop all
+	// seeking, so this follows the recent seeks rather than the worst.
+	cost += (clamp(0, seconds, 30) - cost) * 0.3;
+}
+
+std::unique_ptr<Drift_Controller> make_drift_controller(std::string_view name)
+{
+	if (name == "bang_bang" || name == "default")
+		return std::make_unique<Bang_Bang_Controller>();
+	if (name == "pid")
+		return std::make_unique<Pid_Controller>();
+	if (name == "seek_if_cheaper")
+		return std::make_unique<Seek_If_Cheaper_Controller>();
+	return nullptr;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <memory>
+#include <string_view>
+
+// What a drift controller wants done about the current delay. speed is the
+// playback speed to use from now on. With seek set, the player should seek
+// to the canonical time plus seek_ahead instead.
+struct Drift_Action {
+	double speed = 1.0;
+	bool seek = false;
+	double seek_ahead = 0;
+};
+
+// Decides how to bring the player back to the canonical time. delay is the
+// canonical time minus the player's time, so it is positive when the player
+// is behind, and dt is the time since the previous update in seconds. The
+// controller is not consulted while a seek it asked for is in progress.
+class Drift_Controller {
+public:
+	virtual ~Drift_Controller() {}
+	virtual const char *name() const = 0;
+	virtual Drift_Action update(double delay, double dt, bool paused) = 0;
+	// Forgets accumulated state, e.g. after a seek or a file change.
+	virtual void reset() {}
+	// How long the last seek took from being issued until playback
+	// restarted.
+	virtual void seek_done(double /*seconds*/) {}
+};
+
+// Speeds up or slows down by up to 30% in proportion to the delay, with
+// hysteresis, and seeks when the delay is over 5 seconds. This is the rule
+// the player always used.
+class Bang_Bang_Controller : public Drift_Controller {
+public:
+	const char *name() const override { return "bang_bang"; }
+	Drift_Action update(double delay, double dt, bool paused) override;
+	void reset() override;
+
+private:
+	double speed = 1.0;
+};
+
+// PID on the delay with a small dead band. Speed deviation is limited to
+// max_dev and the integral only winds up while the output is not limited.
+class Pid_Controller : public Drift_Controller {
+public:
+	double kp = 0.5, ki = 0.01, kd = 0.02;
+	double max_dev = 0.1;
+	double dead_band = 0.05;
+	double seek_threshold = 5;
+
+	const char *name() const override { return "pid"; }
+	Drift_Action update(double delay, double dt, bool paused) override;
+	void reset() override;
+
+private:
+	double integral = 0;
+	double prev_delay = 0;
+	double derivative = 0;
+	bool have_prev = false;
+};
+
+// Corrects small delays by changing speed like Pid_Controller, but seeks
+// as soon as a seek is cheaper than catching up. The cost of a seek is
+// mostly decoding from the previous keyframe, so it is estimated from how
+// long recent seeks took to restart playback. Catching up costs the time
+// spent at a distorted rate, weighted down by stall_weight since a frozen
+// picture is much more noticeable than a slightly faster one.
+class Seek_If_Cheaper_Controller : public Drift_Controller {
+public:
+	double max_dev = 0.1;
+	double stall_weight = 10;
+	double min_seek = 0.5;
+
+	const char *name() const override { return "seek_if_cheaper"; }
+	Drift_Action update(double delay, double dt, bool paused) override;
+	void reset() override;
+	void seek_done(double seconds) override;
+
+	double seek_cost() const { return cost; }
+
+private:
+	Pid_Controller pid;
+	double cost = 0.25;
+};
+
+// Returns nullptr for an unknown name.
+std::unique_ptr<Drift_Controller> make_drift_controller(std::string_view name);
@@ -0,0 +1,293 @@
+// Simulation harness for synchronisation: the canonical clock over long
+// sessions and the drift controllers that follow it.
+//
+// The first part simulates a multi-hour session against a virtual monotonic
+// clock and compares the canonical time kept by Canonical_Clock with the
+// previous approach of adding the loop's frame delta to c_time every
+// iteration. The main loop runs at about 60 Hz, idles for 250 ms at a time
+// and now and then stalls for seconds. Pause toggles and seeks arrive at
+// random moments and take effect when the loop handles them; the canonical
+// time is read at random moments in between, as the UI and status replies
+// would. The ground truth is kept in integer microseconds.
+//
+// The second part runs every drift controller against a model of the
+// player: a starting offset, a playback clock that runs slightly off, time
+// positions only as fresh as the last frame, and seeks whose cost depends
+// on the keyframe distance. For each strategy it reports how long it takes
+// to stay within 0.1 s, how far it overshoots, how much it distorts the
+// playback rate (the integral of |speed - 1|) and how long playback stalls
+// in seeks.
+//
+// make sync_sim && ./sync_sim [hours] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include "clock.h"
+#include "sync.h"
+
+// The old scheme: c_time only moves when the loop runs, and the whole
+// interval since the last iteration is attributed to the pause state that
+// holds after the commands handled in this iteration.
+struct Accumulated_Clock {
+	double c_time = 0;
+	bool c_paused = true;
+	int64_t last_us = 0;
+
+	void advance(int64_t now_us)
+	{
+		double dt = (now_us - last_us) / 1e6;
+		last_us = now_us;
+		if (!c_paused)
+			c_time += dt;
+	}
+};
+
+struct Error_Stats {
+	double max = 0;
+	double sum = 0;
+	uint64_t n = 0;
+
+	void add(double err)
+	{
+		err = std::fabs(err);
+		if (err > max)
+			max = err;
+		sum += err;
+		n++;
+	}
+};
+
+static bool clock_drift(double hours, unsigned seed)
+{
+	std::mt19937_64 rng(seed);
+	std::uniform_real_distribution<double> uniform(0, 1);
+
+	const int64_t end_us = (int64_t)(hours * 3600e6);
+	int64_t now = 0;
+	int64_t truth_us = 0;
+	bool truth_paused = true;
+	int64_t truth_at = 0;
+
+	Canonical_Clock anchored;
+	anchored.set(0, 0, true);
+	Accumulated_Clock accumulated;
+
+	// Commands that have arrived but are not handled yet.
+	bool pending_toggle = false;
+	bool pending_seek = false;
+	int64_t seek_to_us = 0;
+
+	Error_Stats anchored_err, accumulated_err;
+	uint64_t iterations = 0, stalls = 0, toggles = 0, seeks = 0;
+
+	while (now < end_us) {
+		// Length of this iteration: a frame, an idle wait or a stall.
+		double r = uniform(rng);
+		int64_t step;
+		if (r < 0.0005)
+			step = (int64_t)(500000 + uniform(rng) * 2500000), stalls++;
+		else if (r < 0.2)
+			step = 250000;
+		else
+			step = 16667 + (int64_t)(uniform(rng) * 2000);
+
+		// Commands and reads land somewhere inside the interval.
+		if (uniform(rng) < 0.002)
+			pending_toggle = true;
+		if (uniform(rng) < 0.0005) {
+			pending_seek = true;
+			seek_to_us = (int64_t)(uniform(rng) * 7200e6);
+		}
+		int64_t read_at = now + (int64_t)(uniform(rng) * step);
+		int64_t truth_read = truth_paused ? truth_us : truth_us + (read_at - truth_at);
+		anchored_err.add(anchored.time(read_at) - truth_read / 1e6);
+		accumulated_err.add(accumulated.c_time - truth_read / 1e6);
+
+		now += step;
+		iterations++;
+
+		// The loop wakes up and handles what arrived.
+		if (!truth_paused)
+			truth_us += now - truth_at;
+		truth_at = now;
+		if (pending_toggle) {
+			truth_paused = !truth_paused;
+			anchored.set_paused(now, truth_paused);
+			accumulated.c_paused = truth_paused;
+			pending_toggle = false;
+			toggles++;
+		}
+		accumulated.advance(now);
+		if (pending_seek) {
+			truth_us = seek_to_us;
+			anchored.set(now, seek_to_us / 1e6, anchored.paused());
+			accumulated.c_time = seek_to_us / 1e6;
+			pending_seek = false;
+			seeks++;
+		}
+		double truth_now = truth_us / 1e6;
+		anchored_err.add(anchored.time(now) - truth_now);
+		accumulated_err.add(accumulated.c_time - truth_now);
+	}
+
+	printf("simulated %.1f h: %llu iterations, %llu stalls, %llu pause toggles, %llu seeks\n",
+		hours, (unsigned long long)iterations, (unsigned long long)stalls,
+		(unsigned long long)toggles, (unsigned long long)seeks);
+	printf("%-14s max error %12.9f s  mean %12.9f s\n", "accumulated",
+		accumulated_err.max, accumulated_err.sum / accumulated_err.n);
+	printf("%-14s max error %12.9f s  mean %12.9f s\n", "anchored",
+		anchored_err.max, anchored_err.sum / anchored_err.n);
+
+	if (anchored_err.max > 1e-6) {
+		fprintf(stderr, "anchored clock drifted by more than 1 us\n");
+		return false;
+	}
+	return true;
+}
+
+struct Scenario {
+	const char *name;
+	double offset;
+	// The player's clock runs at (1 + bias) times the requested speed.
+	double bias;
+	// A seek costs latency plus decoding from a keyframe up to
+	// keyframe_interval back at decode_speed times real time.
+	double latency, keyframe_interval, decode_speed;
+	double duration;
+};
+
+struct Run_Result {
+	double settle, converge;
+	double overshoot;
+	double distortion;
+	double stall;
+	int seeks;
+};
+
+static Run_Result run_controller(Drift_Controller &c, const Scenario &s, std::mt19937_64 &rng)
+{
+	std::uniform_real_distribution<double> uniform(0, 1);
+	const double dt = 1 / 60.0, fps = 24;
+	const double wide_band = 0.3, band = 0.1;
+
+	c.reset();
+	double canonical = 1000, player = canonical - s.offset;
+	double speed = 1;
+	bool seeking = false;
+	double seek_end = 0, seek_target = 0, seek_cost = 0;
+	double last_outside_wide = 0, last_outside = 0;
+	double sign = s.offset < 0 ? -1 : 1;
+	Run_Result r = {};
+
+	for (double t = 0; t < s.duration; t += dt) {
+		canonical += dt;
+		if (seeking && t >= seek_end) {
+			seeking = false;
+			player = seek_target + (t - seek_end) * (1 + s.bias);
+			c.seek_done(seek_cost);
+			c.reset();
+		} else if (!seeking) {
+			player += dt * speed * (1 + s.bias);
+		}
+
+		double shown = seeking ? seek_target : floor(player * fps) / fps;
+		double delay = canonical - shown;
+		if (fabs(delay) > wide_band)
+			last_outside_wide = t + dt;
+		if (fabs(delay) > band)
+			last_outside = t + dt;
+		r.overshoot = std::max(r.overshoot, -sign * delay);
+		if (seeking) {
+			r.stall += dt;
+			continue;
+		}
+
+		Drift_Action a = c.update(delay, dt, false);
+		if (a.seek) {
+			seeking = true;
+			seek_target = canonical + a.seek_ahead;
+			seek_cost = s.latency + uniform(rng) * s.keyframe_interval / s.decode_speed;
+			seek_end = t + seek_cost;
+			speed = 1;
+			r.seeks++;
+		} else {
+			speed = a.speed;
+			r.distortion += fabs(speed - 1) * dt;
+		}
+	}
+	r.settle = last_outside_wide;
+	r.converge = last_outside;
+	return r;
+}
+
+static void format_converge(char *buf, size_t size, double sum, int n, int runs)
+{
+	if (n == runs)
+		snprintf(buf, size, "%.2fs", sum / runs);
+	else
+		snprintf(buf, size, "%d/%d", n, runs);
+}
+
+static void controllers(unsigned seed)
+{
+	const Scenario scenarios[] = {
+		{"0.4s behind, local", 0.4, 0, 0.03, 2, 20, 120},
+		{"1.5s behind, local", 1.5, 0, 0.03, 2, 20, 120},
+		{"4s ahead, local", -4, 0, 0.03, 2, 20, 120},
+		{"12s behind, local", 12, 0, 0.03, 2, 20, 120},
+		{"1.5s behind, stream", 1.5, 0, 0.8, 10, 4, 120},
+		{"4s ahead, stream", -4, 0, 0.8, 10, 4, 120},
+		{"12s behind, stream", 12, 0, 0.8, 10, 4, 120},
+		{"0.5% slow clock", 0, -0.005, 0.03, 2, 20, 600},
+	};
+	const char *names[] = {"bang_bang", "pid", "seek_if_cheaper"};
+	const int runs = 20;
+
+	printf("\n%-20s %-16s %8s %8s %9s %10s %7s %6s\n", "scenario", "controller",
+		"to 0.3s", "to 0.1s", "overshoot", "distortion", "stall", "seeks");
+	for (auto &s : scenarios) {
+		for (auto name : names) {
+			auto c = make_drift_controller(name);
+			std::mt19937_64 rng(seed);
+			Run_Result sum = {};
+			int settled = 0, converged = 0;
+			for (int i = 0; i < runs; i++) {
+				Run_Result r = run_controller(*c, s, rng);
+				if (r.settle < s.duration - 10) {
+					sum.settle += r.settle;
+					settled++;
+				}
+				if (r.converge < s.duration - 10) {
+					sum.converge += r.converge;
+					converged++;
+				}
+				sum.overshoot = std::max(sum.overshoot, r.overshoot);
+				sum.distortion += r.distortion;
+				sum.stall += r.stall;
+				sum.seeks += r.seeks;
+			}
+			char settle[32], converge[32];
+			format_converge(settle, sizeof(settle), sum.settle, settled, runs);
+			format_converge(converge, sizeof(converge), sum.converge, converged, runs);
+			printf("%-20s %-16s %8s %8s %8.3fs %9.3fs %6.2fs %6.1f\n", s.name, name,
+				settle, converge, sum.overshoot, sum.distortion / runs,
+				sum.stall / runs, (double)sum.seeks / runs);
+		}
+	}
+	printf("to 0.3s, to 0.1s: mean time until the delay stays within that,\n"
+		"  or how many runs got there at all\n"
+		"overshoot: worst delay past zero in the opposite direction\n"
+		"distortion: integral of |speed - 1|, stall: time spent seeking; both per run\n");
+}
+
+int main(int argc, char **argv)
+{
+	double hours = argc > 1 ? atof(argv[1]) : 6;
+	unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+	bool ok = clock_drift(hours, seed);
+	controllers(seed);
+	return ok ? 0 : 1;
+}
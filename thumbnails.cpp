@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mpv/client.h>
+#include <mpv/render.h>
+#include "thumbnails.h"
+#include "resolver.h"
+#include "trace.h"
+
+void Thumbnailer::set_file(const std::string &p, const std::shared_ptr<const Stream_Headers> &h, void (*wake_cb)(void *))
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (thread_started && p == path)
+			return;
+		path = p;
+		headers = h;
+		path_changed = true;
+		wake = wake_cb;
+		hovered_time.reset();
+		queue_count = 0;
+		failed_count = 0;
+		generation++;
+	}
+	if (!thread_started) {
+		thread_started = true;
+		std::thread(&Thumbnailer::run, this).detach();
+	}
+	cond.notify_one();
+}
+
+// Whether time is waiting, being decoded, done but not taken, or failed.
+bool Thumbnailer::requested(double time) const
+{
+	if (hovered_time == time || decoding_time == time)
+		return true;
+	for (size_t i = 0; i < queue_count; i++)
+		if (queue[(queue_head + i) % max_queued] == time)
+			return true;
+	for (size_t i = 0; i < failed_count; i++)
+		if (failed[i] == time)
+			return true;
+	for (auto &t : done)
+		if (t.file == generation && t.time == time)
+			return true;
+	return false;
+}
+
+void Thumbnailer::want(double time, bool hovered)
+{
+	if (disabled)
+		return;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (requested(time))
+			return;
+		if (hovered) {
+			hovered_time = time;
+		} else {
+			// The oldest gives way.
+			if (queue_count == max_queued) {
+				queue_head = (queue_head + 1) % max_queued;
+				queue_count--;
+			}
+			queue[(queue_head + queue_count++) % max_queued] = time;
+		}
+	}
+	cond.notify_one();
+}
+
+bool Thumbnailer::take(Thumbnail &out)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	while (!done.empty()) {
+		out = std::move(done.back());
+		done.pop_back();
+		// Of a file since replaced.
+		if (out.file != generation)
+			continue;
+		if (out.pixels.empty()) {
+			failed[failed_next] = out.time;
+			failed_next = (failed_next + 1) % max_failed;
+			failed_count = std::min(failed_count + 1, max_failed);
+		}
+		return true;
+	}
+	return false;
+}
+
+// Blocks until there is a file to load or a thumbnail to make.
+bool Thumbnailer::next_request(double &time, std::string &load, std::shared_ptr<const Stream_Headers> &load_headers, uint64_t &file)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	decoding_time.reset();
+	cond.wait(guard, [&] { return path_changed || hovered_time.has_value() || queue_count > 0; });
+	load.clear();
+	bool changed = path_changed;
+	if (changed) {
+		load = path;
+		load_headers = headers;
+		path_changed = false;
+	}
+	file = generation;
+	if (hovered_time.has_value()) {
+		time = *hovered_time;
+		hovered_time.reset();
+	} else if (queue_count > 0) {
+		time = queue[queue_head];
+		queue_head = (queue_head + 1) % max_queued;
+		queue_count--;
+	} else {
+		time = -1;
+	}
+	if (time >= 0)
+		decoding_time = time;
+	return changed;
+}
+
+// Handles events until one of the given kind, false if the file ended or
+// failed first or it took longer than timeout seconds. With ctx, waits for
+// a new frame after the event too.
+static bool wait_for(mpv_handle *mpv, mpv_render_context *ctx, mpv_event_id id, double timeout)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+	bool seen = false;
+	while (1) {
+		double left = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count();
+		if (left <= 0)
+			return false;
+		mpv_event *e = mpv_wait_event(mpv, left);
+		if (e->event_id == id)
+			seen = true;
+		else if (e->event_id == MPV_EVENT_END_FILE || e->event_id == MPV_EVENT_SHUTDOWN)
+			return false;
+		if (seen && (ctx == nullptr || (mpv_render_context_update(ctx) & MPV_RENDER_UPDATE_FRAME)))
+			return true;
+	}
+}
+
+// The headers the main instance opened the file with, which a resolved
+// stream may not open without.
+static void set_headers(mpv_handle *mpv, const Stream_Headers &h)
+{
+	mpv_set_property_string(mpv, "user-agent", h.user_agent.c_str());
+	mpv_set_property_string(mpv, "referrer", h.referrer.c_str());
+	std::vector<mpv_node> values(h.fields.size());
+	for (size_t i = 0; i < h.fields.size(); i++) {
+		values[i].format = MPV_FORMAT_STRING;
+		values[i].u.string = const_cast<char *>(h.fields[i].c_str());
+	}
+	mpv_node_list list = { (int)values.size(), values.data(), nullptr };
+	mpv_node node;
+	node.format = MPV_FORMAT_NODE_ARRAY;
+	node.u.list = &list;
+	mpv_set_property(mpv, "http-header-fields", MPV_FORMAT_NODE, &node);
+}
+
+void Thumbnailer::run()
+{
+	trace_thread_name("thumbnails");
+	mpv_handle *mpv = mpv_create();
+	const char *options[][2] = {
+		{ "vo", "libmpv" },
+		{ "ao", "null" },
+		{ "aid", "no" },
+		{ "sid", "no" },
+		{ "hwdec", "no" },
+		{ "hr-seek", "no" },
+		{ "pause", "yes" },
+		{ "idle", "yes" },
+		{ "keep-open", "always" },
+		{ "vd-lavc-skiploopfilter", "all" },
+		{ "vd-lavc-fast", "yes" },
+		// One keyframe at a time is all that is read, so a small cache
+		// keeps this instance from taking as much memory as the main one.
+		{ "demuxer-max-bytes", "4MiB" },
+		{ "demuxer-max-back-bytes", "0" },
+		{ "demuxer-readahead-secs", "0" },
+	};
+	for (auto &o : options)
+		mpv_set_option_string(mpv, o[0], o[1]);
+	mpv_initialize(mpv);
+
+	mpv_render_param render_params[] = {
+		{ MPV_RENDER_PARAM_API_TYPE, const_cast<char *>(MPV_RENDER_API_TYPE_SW) },
+		{ MPV_RENDER_PARAM_INVALID, nullptr }
+	};
+	mpv_render_context *ctx = nullptr;
+	if (mpv_render_context_create(&ctx, mpv, render_params) < 0) {
+		fprintf(stderr, "thumbnails: could not create render context\n");
+		// want() stops queueing what nobody would serve.
+		disabled = true;
+		mpv_terminate_destroy(mpv);
+		return;
+	}
+	// New frames are waited for in mpv_wait_event.
+	mpv_render_context_set_update_callback(ctx, [](void *m) { mpv_wakeup((mpv_handle *)m); }, mpv);
+
+	bool loaded = false;
+	while (1) {
+		double time;
+		std::string load;
+		std::shared_ptr<const Stream_Headers> load_headers;
+		uint64_t file;
+		if (next_request(time, load, load_headers, file)) {
+			TRACE_SCOPE("thumbnail_load");
+			if (load.empty()) {
+				const char *stop[] = { "stop", nullptr };
+				mpv_command(mpv, stop);
+				loaded = false;
+			} else {
+				if (load_headers != nullptr)
+					set_headers(mpv, *load_headers);
+				const char *cmd[] = { "loadfile", load.c_str(), nullptr };
+				loaded = mpv_command(mpv, cmd) >= 0
+					&& wait_for(mpv, nullptr, MPV_EVENT_FILE_LOADED, 20);
+			}
+		}
+		if (time < 0)
+			continue;
+
+		Thumbnail t = { file, time, {} };
+		if (loaded) {
+			TRACE_SCOPE("thumbnail");
+			char arg[32];
+			snprintf(arg, sizeof arg, "%.3f", time);
+			const char *seek[] = { "seek", arg, "absolute+keyframes", nullptr };
+			// Forget about frames from before the seek.
+			mpv_render_context_update(ctx);
+			if (mpv_command(mpv, seek) >= 0 && wait_for(mpv, ctx, MPV_EVENT_PLAYBACK_RESTART, 5)) {
+				t.pixels.resize((size_t)width * height * 4);
+				int size[2] = { width, height };
+				size_t stride = width * 4;
+				mpv_render_param params[] = {
+					{ MPV_RENDER_PARAM_SW_SIZE, size },
+					{ MPV_RENDER_PARAM_SW_FORMAT, const_cast<char *>("rgb0") },
+					{ MPV_RENDER_PARAM_SW_STRIDE, &stride },
+					{ MPV_RENDER_PARAM_SW_POINTER, t.pixels.data() },
+					{ MPV_RENDER_PARAM_INVALID, nullptr }
+				};
+				if (mpv_render_context_render(ctx, params) < 0)
+					t.pixels.clear();
+			}
+		}
+
+		void (*wake_cb)(void *);
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			done.push_back(std::move(t));
+			decoding_time.reset();
+			wake_cb = wake;
+		}
+		wake_cb(nullptr);
+	}
+}
+
+bool Thumbnail_Atlas::upload(Thumbnailer &t)
+{
+	bool any = false;
+	Thumbnailer::Thumbnail th;
+	while (t.take(th)) {
+		any = true;
+		if (th.pixels.empty())
+			continue;
+		TRACE_SCOPE("thumbnail_upload");
+		if (texture == 0) {
+			glGenTextures(1, &texture);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			// RGB, so the padding byte of rgb0 is not taken for alpha.
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
+
+		Slot *victim = &slots[0];
+		for (auto &s : slots)
+			if (s.used < victim->used)
+				victim = &s;
+		*victim = { th.file, th.time, ++uses };
+		int i = victim - slots;
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, (i % cols) * Thumbnailer::width, (i / cols) * Thumbnailer::height,
+			Thumbnailer::width, Thumbnailer::height, GL_RGBA, GL_UNSIGNED_BYTE, th.pixels.data());
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	return any;
+}
+
+bool Thumbnail_Atlas::find(uint64_t file, double time, ImTextureID &tex, ImVec2 &uv0, ImVec2 &uv1)
+{
+	for (int i = 0; i < cols * rows; i++) {
+		Slot &s = slots[i];
+		if (s.used == 0 || s.file != file || s.time != time)
+			continue;
+		s.used = ++uses;
+		tex = (ImTextureID)(intptr_t)texture;
+		uv0 = ImVec2((float)(i % cols) * Thumbnailer::width / size, (float)(i / cols) * Thumbnailer::height / size);
+		uv1 = ImVec2(uv0.x + (float)Thumbnailer::width / size, uv0.y + (float)Thumbnailer::height / size);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+#include "imgui/imgui.h"
+
+struct Stream_Headers;
+
+// Seek bar thumbnails. A second mpv instance of its own, video only and
+// seeking to keyframes, decodes them on a thread of its own and renders
+// them in software; the render thread only queues requests and uploads
+// finished pictures into a texture atlas, so it never waits for a decode.
+// Nothing is started until the first thumbnail is wanted.
+//
+// Times are keys: the same time asked for again finds the same thumbnail,
+// so callers should round them to a step first.
+class Thumbnailer {
+public:
+	static constexpr int width = 192, height = 108;
+
+	struct Thumbnail {
+		uint64_t file;
+		double time;
+		// RGBX, or empty if the frame could not be decoded.
+		std::vector<uint8_t> pixels;
+	};
+
+	// Render thread. Thumbnails are of path, opened with headers, from here
+	// on; wake is called from the decoder thread when one is done.
+	void set_file(const std::string &path, const std::shared_ptr<const Stream_Headers> &headers, void (*wake)(void *));
+	uint64_t file() const { return generation; }
+	// False again if the decoder could not be set up.
+	bool started() const { return thread_started && !disabled; }
+	// Asks for a thumbnail unless it is queued or failed already. One
+	// for the hovered time goes before all others and replaces the last.
+	// Does not allocate, as it runs on frames that otherwise do not.
+	void want(double time, bool hovered);
+	bool take(Thumbnail &out);
+
+private:
+	// Only this many positions are waited for at a time; older ones are no
+	// longer near the mouse or the playback position. Failures are
+	// remembered as long as they fit.
+	static constexpr size_t max_queued = 16, max_failed = 64;
+
+	void run();
+	bool next_request(double &time, std::string &load, std::shared_ptr<const Stream_Headers> &load_headers, uint64_t &file);
+	bool requested(double time) const;
+
+	bool thread_started = false;
+	uint64_t generation = 0;
+	std::atomic<bool> disabled = false;
+
+	// Shared with the decoder thread. queue and failed are rings.
+	std::mutex lock;
+	std::condition_variable cond;
+	std::string path;
+	std::shared_ptr<const Stream_Headers> headers;
+	bool path_changed = false;
+	void (*wake)(void *) = nullptr;
+	std::optional<double> hovered_time, decoding_time;
+	std::array<double, max_queued> queue;
+	size_t queue_head = 0, queue_count = 0;
+	std::array<double, max_failed> failed;
+	size_t failed_next = 0, failed_count = 0;
+	std::vector<Thumbnail> done;
+};
+
+// Thumbnails as sub-rectangles of one texture, evicting the least recently
+// drawn when it is full. Render thread only.
+class Thumbnail_Atlas {
+public:
+	// Uploads what the thumbnailer finished. Returns whether there was any.
+	bool upload(Thumbnailer &t);
+	// Whether the thumbnail is in the atlas, and where; counts as a use.
+	bool find(uint64_t file, double time, ImTextureID &texture, ImVec2 &uv0, ImVec2 &uv1);
+
+private:
+	static constexpr int size = 1024;
+	static constexpr int cols = size / Thumbnailer::width, rows = size / Thumbnailer::height;
+
+	struct Slot {
+		uint64_t file = 0;
+		double time = 0;
+		uint64_t used = 0;
+	};
+
+	GLuint texture = 0;
+	Slot slots[cols * rows];
+	uint64_t uses = 0;
+};
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "trace.h"
+
+std::atomic<bool> trace_on = false;
+
+// One per thread that has recorded anything, never freed so that dumps can
+// still read the events of threads that have exited. Only the owning thread
+// writes. Readers on other threads copy events out and then discard those
+// the owner may have overwritten meanwhile, so the event fields are atomics
+// only to keep those racy reads defined.
+struct Trace_Buffer {
+	static constexpr size_t size = 1 << 16;
+
+	struct Event {
+		std::atomic<const char *> name;
+		std::atomic<int64_t> start_us, end_us;
+	};
+
+	std::string thread_name;
+	int tid;
+	std::atomic<uint64_t> count = 0;
+	Event events[size];
+};
+
+static std::mutex buffers_lock;
+static std::vector<Trace_Buffer *> buffers;
+static thread_local Trace_Buffer *local_buffer;
+static thread_local const char *local_name;
+
+// Made on the first event, so threads cost nothing while tracing is off.
+static Trace_Buffer *get_local_buffer()
+{
+	if (local_buffer == nullptr) {
+		auto b = new Trace_Buffer;
+		std::lock_guard<std::mutex> guard(buffers_lock);
+		b->tid = buffers.size() + 1;
+		b->thread_name = local_name != nullptr ? local_name : "thread " + std::to_string(b->tid);
+		buffers.push_back(b);
+		local_buffer = b;
+	}
+	return local_buffer;
+}
+
+int64_t trace_now_us()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_record(const char *name, int64_t start_us, int64_t end_us)
+{
+	Trace_Buffer *b = get_local_buffer();
+	uint64_t n = b->count.load(std::memory_order_relaxed);
+	auto &e = b->events[n % Trace_Buffer::size];
+	e.name.store(name, std::memory_order_relaxed);
+	e.start_us.store(start_us, std::memory_order_relaxed);
+	e.end_us.store(end_us, std::memory_order_relaxed);
+	b->count.store(n + 1, std::memory_order_release);
+}
+
+void trace_set_enabled(bool enabled)
+{
+	trace_on = enabled;
+}
+
+void trace_thread_name(const char *name)
+{
+	local_name = name;
+	if (local_buffer == nullptr)
+		return;
+	std::lock_guard<std::mutex> guard(buffers_lock);
+	local_buffer->thread_name = name;
+}
+
+struct Copied_Event {
+	const char *name;
+	int64_t start_us, end_us;
+	int tid;
+};
+
+// The events of every thread that ended after since_us.
+static std::vector<Copied_Event> copy_events(int64_t since_us, std::vector<std::pair<int, std::string>> *threads)
+{
+	std::vector<Trace_Buffer *> bs;
+	{
+		std::lock_guard<std::mutex> guard(buffers_lock);
+		bs = buffers;
+		if (threads != nullptr)
+			for (auto b : bs)
+				threads->push_back({ b->tid, b->thread_name });
+	}
+
+	std::vector<Copied_Event> out;
+	for (auto b : bs) {
+		uint64_t end = b->count.load(std::memory_order_acquire);
+		uint64_t begin = end > Trace_Buffer::size ? end - Trace_Buffer::size : 0;
+		size_t first = out.size();
+		for (uint64_t i = begin; i < end; i++) {
+			auto &e = b->events[i % Trace_Buffer::size];
+			out.push_back({
+				e.name.load(std::memory_order_relaxed),
+				e.start_us.load(std::memory_order_relaxed),
+				e.end_us.load(std::memory_order_relaxed),
+				b->tid
+			});
+		}
+		// Whatever the owner wrote while we were copying replaced the
+		// oldest events; drop those.
+		uint64_t now = b->count.load(std::memory_order_acquire);
+		uint64_t overwritten = now > Trace_Buffer::size ? now - Trace_Buffer::size : 0;
+		if (overwritten > begin)
+			out.erase(out.begin() + first, out.begin() + first + std::min(overwritten - begin, end - begin));
+		out.erase(std::remove_if(out.begin() + first, out.end(),
+			[&](const Copied_Event &e) { return e.end_us < since_us; }), out.end());
+	}
+	return out;
+}
+
+std::vector<Trace_Stage> trace_summary(double seconds)
+{
+	auto events = copy_events(trace_now_us() - (int64_t)(seconds * 1e6), nullptr);
+
+	// Names are literals, but the same text may have several addresses.
+	auto less = [](const char *a, const char *b) { return strcmp(a, b) < 0; };
+	std::map<const char *, std::vector<int64_t>, decltype(less)> durations(less);
+	for (auto &e : events)
+		durations[e.name].push_back(e.end_us - e.start_us);
+
+	std::vector<Trace_Stage> stages;
+	for (auto &[name, d] : durations) {
+		std::sort(d.begin(), d.end());
+		auto pct = [&](double p) { return d[std::min(d.size() - 1, (size_t)(p * d.size()))] / 1000.0; };
+		stages.push_back({ name, d.size(), pct(0.5), pct(0.99) });
+	}
+	return stages;
+}
+
+int64_t trace_dump(const std::string &path, double seconds)
+{
+	std::vector<std::pair<int, std::string>> threads;
+	auto events = copy_events(trace_now_us() - (int64_t)(seconds * 1e6), &threads);
+
+	FILE *f = fopen(path.c_str(), "w");
+	if (f == nullptr)
+		return -1;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (auto &[tid, name] : threads) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", tid, name.c_str());
+		first = false;
+	}
+	for (auto &e : events) {
+		fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+			first ? "" : ",\n", e.name, e.tid, (long long)e.start_us, (long long)(e.end_us - e.start_us));
+		first = false;
+	}
+	fprintf(f, "\n]}\n");
+	bool ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	return ok ? (int64_t)events.size() : -1;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Scoped timers for finding out where a frame's time goes. Each thread
+// records finished scopes into its own ring of recent events; nothing is
+// shared between threads on the recording path. While tracing is off a
+// scope costs one relaxed load. Building with MOOV_NO_TRACE removes the
+// scopes altogether.
+//
+//	TRACE_SCOPE("swap");
+//
+// Names must be string literals or otherwise live forever.
+
+extern std::atomic<bool> trace_on;
+
+int64_t trace_now_us();
+void trace_record(const char *name, int64_t start_us, int64_t end_us);
+void trace_set_enabled(bool enabled);
+// Names the calling thread in dumps. name must live forever, like scope
+// names.
+void trace_thread_name(const char *name);
+
+class Trace_Scope {
+public:
+	explicit Trace_Scope(const char *name)
+		: name(name), start(trace_on.load(std::memory_order_relaxed) ? trace_now_us() : -1)
+	{
+	}
+
+	~Trace_Scope()
+	{
+		if (start >= 0)
+			trace_record(name, start, trace_now_us());
+	}
+
+	Trace_Scope(const Trace_Scope &) = delete;
+	Trace_Scope &operator=(const Trace_Scope &) = delete;
+
+private:
+	const char *name;
+	int64_t start;
+};
+
+#ifdef MOOV_NO_TRACE
+#define TRACE_SCOPE(name) ((void)0)
+#else
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) Trace_Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#endif
+
+struct Trace_Stage {
+	const char *name;
+	size_t count;
+	double p50_ms, p99_ms;
+};
+
+// Duration percentiles per scope name over the last seconds, across all
+// threads, sorted by name.
+std::vector<Trace_Stage> trace_summary(double seconds);
+
+// Writes the events of the last seconds as Chrome trace event JSON, which
+// chrome://tracing and Perfetto open. Returns the number of events written,
+// or -1 if the file could not be written.
+int64_t trace_dump(const std::string &path, double seconds);
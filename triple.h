@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+
+// Latest-value hand-off from one writer thread to one reader thread. The
+// writer fills back() and publishes it; the reader picks up the most
+// recently published value with update() and reads it through front().
+// Neither side ever waits for the other, and values that were published
+// but not picked up in time are simply skipped.
+template <typename T>
+class Triple_Buffer {
+public:
+	// Writer.
+	T &back()
+	{
+		return bufs[back_i];
+	}
+
+	void publish()
+	{
+		int old = middle.exchange(back_i | fresh, std::memory_order_acq_rel);
+		back_i = old & ~fresh;
+	}
+
+	// Reader. Returns whether front() changed.
+	bool update()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & fresh))
+			return false;
+		int old = middle.exchange(front_i, std::memory_order_acq_rel);
+		front_i = old & ~fresh;
+		return true;
+	}
+
+	const T &front() const
+	{
+		return bufs[front_i];
+	}
+
+private:
+	static constexpr int fresh = 4;
+
+	T bufs[3] = {};
+	int back_i = 0;
+	alignas(64) std::atomic<int> middle = 1;
+	alignas(64) int front_i = 2;
+};
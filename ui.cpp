@@ -1,6 +1,20 @@
+#include <math.h>
+#include <string.h>
+
 #include "imgui/imgui.h"
 #include "ui.h"
 
+// Sizes of recently measured strings. What the UI measures is a few dozen
+// short labels and indicators, so a small table in which a new string just
+// replaces whatever was in its slot is enough.
+struct Text_Size_Entry {
+	ImFont *font;
+	char text[24];
+	ImVec2 size;
+};
+
+static Text_Size_Entry text_sizes[64];
+
 ImVec2 operator+(ImVec2 a, ImVec2 b)
 {
 	return ImVec2(a.x + b.x, a.y + b.y);
@@ -26,12 +40,30 @@ bool operator!=(const ImVec2 &a, const ImVec2 &b)
 	return !(a == b);
 }
 
-ImVec2 calc_text_size(ImFont *font, ImVec2 padding, const char *text)
+static ImVec2 measure_text(ImFont *font, const char *text)
 {
 	ImGui::PushFont(font);
 	auto size = ImGui::CalcTextSize(text);
 	ImGui::PopFont();
-	return size + 2 * padding;
+	return size;
+}
+
+ImVec2 calc_text_size(ImFont *font, ImVec2 padding, const char *text)
+{
+	size_t len = strlen(text);
+	if (len >= sizeof(Text_Size_Entry::text))
+		return measure_text(font, text) + 2 * padding;
+
+	uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)font;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (uint8_t)text[i]) * 16777619u;
+	auto &e = text_sizes[h % (sizeof(text_sizes) / sizeof(text_sizes[0]))];
+	if (e.font != font || strcmp(e.text, text) != 0) {
+		e.font = font;
+		memcpy(e.text, text, len + 1);
+		e.size = measure_text(font, text);
+	}
+	return e.size + 2 * padding;
 }
 
 ImRect calc_text_l(float &lcurs, float y, ImVec2 padding, ImFont *font, const char *label)
@@ -52,7 +84,7 @@ ImRect calc_text_r(float &rcurs, float y, ImVec2 padding, ImFont *font, const ch
 	return r;
 }
 
-bool intersects_rect(ImVec2 &v, ImRect &r) {
+bool intersects_rect(const ImVec2 &v, const ImRect &r) {
 	return r.pos.x <= v.x && v.x <= r.pos.x + r.size.x && r.pos.y <= v.y && v.y <= r.pos.y + r.size.y;
 };
 
@@ -151,3 +183,94 @@ Layout calculate_layout(
 
 	return l;
 }
+
+const Layout &cached_layout(Layout_Cache &c,
+	int text_height, int win_w, int win_h, ImFont *text_font, ImFont *icon_font)
+{
+	if (c.text_height != text_height || c.win_w != win_w || c.win_h != win_h ||
+		c.text_font != text_font || c.icon_font != icon_font)
+	{
+		c.layout = calculate_layout(text_height, win_w, win_h, text_font, icon_font);
+		c.text_height = text_height;
+		c.win_w = win_w;
+		c.win_h = win_h;
+		c.text_font = text_font;
+		c.icon_font = icon_font;
+	}
+	return c.layout;
+}
+
+ImVec2 message_text_size(Chat_Message &m, float wrap_width)
+{
+	auto &g = m.geometry;
+	ImFont *font = ImGui::GetFont();
+	if (g.wrap_width != wrap_width || g.font != font) {
+		g.wrap_width = wrap_width;
+		g.font = font;
+		g.text_size = ImGui::CalcTextSize(m.text.data(), m.text.data() + m.text.size(), false, wrap_width);
+		g.built = false;
+	}
+	return g.text_size;
+}
+
+bool message_geometry_current(const Chat_Message &m, float wrap_width, float padding)
+{
+	auto &g = m.geometry;
+	return g.built && g.wrap_width == wrap_width && g.padding == padding &&
+		g.font == ImGui::GetFont();
+}
+
+// Builds into a scratch list so that ImGui does the tessellation, then
+// keeps a copy. Only messages that fit the chat log are drawn, so one is
+// well within the reach of 16-bit indices.
+static void build_message_geometry(Chat_Message &m, float padding)
+{
+	static ImDrawList scratch(ImGui::GetDrawListSharedData());
+	auto &g = m.geometry;
+	scratch._ResetForNewFrame();
+	scratch.PushClipRectFullScreen();
+	scratch.PushTextureID(g.font->ContainerAtlas->TexID);
+
+	ImVec2 rect_max(g.text_size.x + padding * 2, g.text_size.y + padding * 2);
+	scratch.AddRectFilled(ImVec2(0, 0), rect_max, m.bg, 10);
+	g.bg_vtx_count = scratch.VtxBuffer.Size;
+	scratch.AddText(g.font, ImGui::GetFontSize(), ImVec2(padding, padding), m.fg,
+		m.text.data(), m.text.data() + m.text.size(), g.wrap_width);
+
+	g.vtx.assign(scratch.VtxBuffer.begin(), scratch.VtxBuffer.end());
+	g.idx.assign(scratch.IdxBuffer.begin(), scratch.IdxBuffer.end());
+	g.padding = padding;
+	g.built = true;
+}
+
+static uint32_t scale_alpha(uint32_t col, float factor)
+{
+	uint32_t alpha = col >> IM_COL32_A_SHIFT;
+	uint32_t scaled_alpha = (uint32_t)(factor * alpha + 0.5f);
+	return (col & ~IM_COL32_A_MASK) | (scaled_alpha << IM_COL32_A_SHIFT);
+}
+
+void draw_message(ImDrawList *draw_list, Chat_Message &m, ImVec2 pos, float wrap_width, float padding,
+	float fg_alpha, float bg_alpha)
+{
+	auto &g = m.geometry;
+	message_text_size(m, wrap_width);
+	if (!g.built || g.padding != padding)
+		build_message_geometry(m, padding);
+
+	// Glyphs were placed on whole pixels, so keep them there.
+	pos = ImVec2(floorf(pos.x), floorf(pos.y));
+	draw_list->PrimReserve(g.idx.size(), g.vtx.size());
+	// Read after reserving, which may have started a new vertex offset.
+	ImDrawIdx base = draw_list->_VtxCurrentIdx;
+	for (size_t i = 0; i < g.vtx.size(); i++) {
+		ImDrawVert v = g.vtx[i];
+		v.pos = v.pos + pos;
+		v.col = scale_alpha(v.col, i < g.bg_vtx_count ? bg_alpha : fg_alpha);
+		*draw_list->_VtxWritePtr++ = v;
+	}
+	for (ImDrawIdx i : g.idx)
+		*draw_list->_IdxWritePtr++ = base + i;
+	draw_list->_VtxCurrentIdx += g.vtx.size();
+}
+
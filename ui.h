@@ -56,12 +56,36 @@ struct Layout {
 	ImRect chat_input;
 };
 
+// The last layout and what it was calculated from. It only depends on
+// those, so it needs recalculating only on resize or a font change. Fonts
+// are loaded once at startup, so a font is known by its pointer.
+struct Layout_Cache {
+	int text_height = -1, win_w = -1, win_h = -1;
+	ImFont *text_font = nullptr, *icon_font = nullptr;
+	Layout layout;
+};
+
 Layout calculate_layout(int text_height, int win_w, int win_h,
 	ImFont *text_font, ImFont *icon_font);
+const Layout &cached_layout(Layout_Cache &c,
+	int text_height, int win_w, int win_h, ImFont *text_font, ImFont *icon_font);
 ImVec2 operator+(ImVec2 a, ImVec2 b);
 ImVec2 operator-(ImVec2 a, ImVec2 b);
 ImVec2 operator*(int a, ImVec2 b);
 bool operator==(const ImVec2 &a, const ImVec2 &b);
 bool operator!=(const ImVec2 &a, const ImVec2 &b);
+// Sizes of short strings are remembered, so measuring the same label every
+// frame is cheap.
 ImVec2 calc_text_size(ImFont *font, ImVec2 padding, const char *string);
-bool intersects_rect(ImVec2 &v, ImRect &r);
+
+// The size of a chat message's text wrapped at wrap_width in the current
+// font, measured again only when either changed.
+ImVec2 message_text_size(Chat_Message &m, float wrap_width);
+// Whether draw_message can use what it built before.
+bool message_geometry_current(const Chat_Message &m, float wrap_width, float padding);
+// Draws a chat message with its background at pos from geometry that is
+// rebuilt only when the wrap width, padding or font changed. Fading just
+// scales the alpha of the stored vertices.
+void draw_message(ImDrawList *draw_list, Chat_Message &m, ImVec2 pos, float wrap_width, float padding,
+	float fg_alpha, float bg_alpha);
+bool intersects_rect(const ImVec2 &v, const ImRect &r);
@@ -7,8 +7,9 @@
 #include <assert.h>
 #include <string>
 #include <iostream>
-#include <sstream>
-#include <iomanip>
+#include <charconv>
+
+#include "moov.h"
 
 void die(std::string_view str)
 {
@@ -16,13 +17,27 @@ void die(std::string_view str)
 	exit(EXIT_FAILURE);
 }
 
-std::string sec_to_timestr(uint32_t sec)
+static char *put_two_digits(char *p, char *end, uint32_t v)
+{
+	if (v < 10)
+		*p++ = '0';
+	return std::to_chars(p, end, v).ptr;
+}
+
+char *sec_to_timestr(char *buf, uint32_t sec)
 {
-    std::stringstream ss;
-	ss << std::setfill('0')
-	   << std::setw(2) << (sec / 3600) << ":"
-	   << std::setw(2) << ((sec % 3600) / 60) << ":"
-	   << std::setw(2) << (sec % 60);
+	char *end = buf + TIMESTR_SIZE - 1;
+	char *p = put_two_digits(buf, end, sec / 3600);
+	*p++ = ':';
+	p = put_two_digits(p, end, (sec % 3600) / 60);
+	*p++ = ':';
+	p = put_two_digits(p, end, sec % 60);
+	*p = '\0';
+	return buf;
+}
 
-	return ss.str();
+std::string sec_to_timestr(uint32_t sec)
+{
+	char buf[TIMESTR_SIZE];
+	return sec_to_timestr(buf, sec);
 }
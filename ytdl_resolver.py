@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+
+# The resolver worker moov starts once and keeps running: it reads
+# {"url", "format"} requests as JSON lines on stdin and answers each with a
+# line on stdout saying what mpv should open. youtube-dl (or yt-dlp) is
+# imported once here instead of started for every file.
+#
+# With --stub it resolves every URL to generated test media without
+# touching the network, for benchmarks and tests:
+#
+#	moov --headless --resolver='./ytdl_resolver.py --stub'
+
+import json
+import sys
+import threading
+from concurrent.futures import ThreadPoolExecutor
+
+DEFAULT_FORMAT = 'bestvideo+bestaudio/best'
+STUB_MEDIA = 'av://lavfi:testsrc2=size=1280x720:rate=30[out0];sine=frequency=440[out1]'
+
+out_lock = threading.Lock()
+local = threading.local()
+
+
+def reply(msg):
+	with out_lock:
+		sys.stdout.write(json.dumps(msg) + '\n')
+		sys.stdout.flush()
+
+
+def edl_escape(url):
+	return f'%{len(url.encode())}%{url}'
+
+
+# Separate video and audio formats are joined into one EDL stream, like
+# mpv's own ytdl hook does.
+def stream_url(info):
+	formats = info.get('requested_formats')
+	if not formats:
+		return info.get('url')
+	parts = ['!no_clip;!no_chapters;' + edl_escape(f['url']) for f in formats]
+	return 'edl://' + ';!new_stream;'.join(parts)
+
+
+def headers(info):
+	h = info.get('http_headers')
+	if h is None and info.get('requested_formats'):
+		h = info['requested_formats'][0].get('http_headers')
+	return h or {}
+
+
+# User-Agent and Referer have options of their own in mpv; the rest go
+# into http-header-fields, as with mpv's ytdl hook.
+def header_fields(h):
+	return [f'{k}: {v}' for k, v in h.items() if k not in ('User-Agent', 'Referer')]
+
+
+def ydl_for(format):
+	# One per thread and format; the extractors are shared.
+	cache = getattr(local, 'ydls', None)
+	if cache is None:
+		cache = local.ydls = {}
+	if format not in cache:
+		cache[format] = ytdl.YoutubeDL({
+		    'format': format or DEFAULT_FORMAT,
+		    'quiet': True,
+		    'no_warnings': True,
+		    'noplaylist': True,
+		})
+	return cache[format]
+
+
+def resolve(url, format):
+	target = url[len('ytdl://'):] if url.startswith('ytdl://') else url
+	info = ydl_for(format).extract_info(target, download=False)
+	if info.get('_type') == 'playlist':
+		raise ValueError('a playlist, not a video')
+	h = headers(info)
+	return {
+	    'stream_url': stream_url(info),
+	    'title': info.get('title'),
+	    'duration': info.get('duration'),
+	    'uploader': info.get('uploader'),
+	    'uploader_url': info.get('uploader_url'),
+	    'user_agent': h.get('User-Agent'),
+	    'referer': h.get('Referer'),
+	    'header_fields': header_fields(h),
+	}
+
+
+def resolve_stub(url, format):
+	return {'stream_url': STUB_MEDIA, 'title': url, 'duration': None}
+
+
+def handle(req, resolver):
+	res = {'url': req['url'], 'format': req.get('format', '')}
+	try:
+		res.update(resolver(res['url'], res['format']))
+		res['ok'] = True
+	except Exception as e:
+		res['ok'] = False
+		res['error'] = str(e)
+	reply(res)
+
+
+def main():
+	global ytdl
+	resolver = resolve
+	if '--stub' in sys.argv[1:]:
+		resolver = resolve_stub
+	else:
+		try:
+			import yt_dlp as ytdl
+		except ImportError:
+			import youtube_dl as ytdl
+
+	# A slow site should not hold up the others.
+	with ThreadPoolExecutor(max_workers=4) as pool:
+		for line in sys.stdin:
+			try:
+				req = json.loads(line)
+			except ValueError:
+				continue
+			pool.submit(handle, req, resolver)
+
+
+main()